@@ -32,6 +32,9 @@
 
 int bmk_core_init(unsigned long);
 
+/* Size of per-CPU arrays in bmk-core, platforms bring up no more CPUs. */
+#define BMK_CORE_MAXCPUS 64
+
 #define bmk_assert(x)							\
   do {									\
 	if (__builtin_expect(!(x), 0)) {				\
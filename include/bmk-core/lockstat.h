@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BMK_CORE_LOCKSTAT_H_
+#define _BMK_CORE_LOCKSTAT_H_
+
+/*
+ * Lock profiling.  Define BMK_LOCKSTAT to compile it into simple
+ * locks and rumpuser mutexes, then turn it on at runtime with
+ * bmk_lockstat_enable().  Statistics are kept per lock and call site.
+ */
+/* #define BMK_LOCKSTAT */
+
+/* rump kernel code cannot call into bmk directly */
+#if defined(BMK_LOCKSTAT) && defined(_KERNEL)
+#undef BMK_LOCKSTAT
+#endif
+
+enum bmk_lockstat_kind {
+	BMK_LOCKSTAT_SPIN,
+	BMK_LOCKSTAT_MUTEX
+};
+
+void	bmk_lockstat_enable(int);
+void	bmk_lockstat_dump(void);
+
+#ifdef BMK_LOCKSTAT
+#include <bmk-core/types.h>
+
+struct bmk_lockstat_ent;
+
+/* embedded in every lock, describes the current holder */
+struct bmk_lockstat_hold {
+	struct bmk_lockstat_ent *lh_ent;
+	bmk_time_t lh_stamp;
+};
+
+extern int bmk_lockstat_on;
+
+bmk_time_t	bmk_lockstat_now(void);
+void	bmk_lockstat_acquired(struct bmk_lockstat_hold *, const void *,
+			      enum bmk_lockstat_kind, bmk_time_t, void *);
+void	bmk_lockstat_released(struct bmk_lockstat_hold *);
+
+/* address of the code using the macro, also when inlined */
+#define BMK_LOCKSTAT_HERE() ({ __label__ __here; __here: &&__here; })
+
+#define BMK_LOCKSTAT_TIMER(t)	bmk_time_t t = 0
+#define BMK_LOCKSTAT_START(t)						\
+	do {								\
+		if (__builtin_expect(bmk_lockstat_on, 0))		\
+			t = bmk_lockstat_now();				\
+	} while (0)
+#define BMK_LOCKSTAT_STOP(t)						\
+	do {								\
+		if (t != 0)						\
+			t = bmk_lockstat_now() - t + 1;			\
+	} while (0)
+#define BMK_LOCKSTAT_ACQUIRED(h, lock, kind, t, pc)			\
+	do {								\
+		if (__builtin_expect(bmk_lockstat_on, 0))		\
+			bmk_lockstat_acquired(h, lock, kind, t, pc);	\
+	} while (0)
+#define BMK_LOCKSTAT_RELEASED(h)					\
+	do {								\
+		if (__builtin_expect((h)->lh_ent != 0, 0))		\
+			bmk_lockstat_released(h);			\
+	} while (0)
+
+#else
+
+#define BMK_LOCKSTAT_TIMER(t)			do { } while (0)
+#define BMK_LOCKSTAT_START(t)			do { } while (0)
+#define BMK_LOCKSTAT_STOP(t)			do { } while (0)
+#define BMK_LOCKSTAT_ACQUIRED(h, lock, kind, t, pc) do { } while (0)
+#define BMK_LOCKSTAT_RELEASED(h)		do { } while (0)
+
+#endif /* BMK_LOCKSTAT */
+
+#endif /* _BMK_CORE_LOCKSTAT_H_ */
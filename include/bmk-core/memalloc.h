@@ -67,6 +67,7 @@ enum bmk_memwho {
 	BMK_MEMWHO_RUMPKERN,
 	BMK_MEMWHO_USER
 };
+#define BMK_MEMWHO_NUM (BMK_MEMWHO_USER+1)
 
 void	bmk_memalloc_init(void);
 
@@ -78,7 +79,21 @@ void *  bmk_memrealloc_user(void *, unsigned long);
 
 void *  bmk_xmalloc_bmk(unsigned long);
 
+/* size-class allocator for user memory */
+void *	bmk_szalloc(unsigned long, unsigned long);
+void *	bmk_szcalloc(unsigned long, unsigned long);
+void *	bmk_szrealloc(void *, unsigned long);
+void	bmk_szfree(void *);
+unsigned long bmk_szsize(void *);
+
+/* accounting for allocators layered on the page allocator */
+void	bmk_memstat_alloc(enum bmk_memwho, unsigned long);
+void	bmk_memstat_free(enum bmk_memwho, unsigned long);
+void	bmk_memstat_sample(enum bmk_memwho, unsigned long, void *);
+
 /* diagnostic */
+void	bmk_memstat_setsampling(unsigned int);
 void	bmk_memalloc_printstats(void);
+void	bmk_szalloc_printstats(void);
 
 #endif /* _BMK_CORE_MEMALLOC_H_ */
@@ -26,11 +26,56 @@
 #ifndef _BMK_CORE_PGALLOC_H_
 #define _BMK_CORE_PGALLOC_H_
 
+#define BMK_PGALLOC_MAXNODES 8
+
+/* large page sizes used by the platform identity mappings */
+#define BMK_PGALLOC_HUGE_SHIFT	21
+#define BMK_PGALLOC_HUGE_SIZE	(1UL<<BMK_PGALLOC_HUGE_SHIFT)
+#define BMK_PGALLOC_GIANT_SHIFT	30
+#define BMK_PGALLOC_GIANT_SIZE	(1UL<<BMK_PGALLOC_GIANT_SHIFT)
+
+struct bmk_pgarena {
+	char *pa_cur;
+	unsigned long pa_left;
+	int pa_node;
+};
+#define BMK_PGARENA_INITIALIZER(node) { NULL, 0, node }
+
 void		bmk_pgalloc_loadmem(unsigned long, unsigned long);
+void		bmk_pgalloc_loadnode(int, unsigned long, unsigned long);
+
+void		bmk_pgalloc_setcpunode(unsigned long, int);
+int		bmk_pgalloc_cpunode(unsigned long);
+int		bmk_pgalloc_addrnode(void *);
+int		bmk_pgalloc_nnodes(void);
+void		bmk_pgalloc_bounds(unsigned long *, unsigned long *);
 
 void *		bmk_pgalloc(int);
 void *		bmk_pgalloc_align(int, unsigned long);
+void *		bmk_pgalloc_node(int, int);
+void *		bmk_pgalloc_align_node(int, unsigned long, int);
 void		bmk_pgfree(void *, int);
+void *		bmk_pgalloc_zero(int);
+
+void *		bmk_pgalloc_npages(unsigned long, unsigned long);
+void *		bmk_pgalloc_npages_zero(unsigned long, unsigned long);
+void *		bmk_pgalloc_npages_node(unsigned long, unsigned long, int);
+void		bmk_pgfree_npages(void *, unsigned long);
+int		bmk_pgalloc_tryextend(void *, unsigned long, unsigned long);
+
+void *		bmk_pgalloc_huge(unsigned long, int);
+void		bmk_pgfree_huge(void *, unsigned long);
+void *		bmk_pgarena_alloc(struct bmk_pgarena *, unsigned long,
+			unsigned long);
+
+unsigned long	bmk_pgalloc_balloon_inflate(unsigned long,
+			int (*)(void *, unsigned long));
+unsigned long	bmk_pgalloc_balloon_deflate(unsigned long,
+			int (*)(void *, unsigned long));
+void		bmk_pgalloc_balloon_attach(int (*)(void *, unsigned long),
+			int (*)(void *, unsigned long));
+void		bmk_pgalloc_balloon_setfree(unsigned long);
+void		bmk_pgalloc_idle(void);
 
 void		bmk_pgalloc_dumpstats(void);
 
@@ -34,6 +34,9 @@ extern unsigned long bmk_numcpus;
 void bmk_platform_halt(const char *) __attribute__((noreturn));
 
 void		bmk_platform_cpu_block(bmk_time_t);
+/* give the physical CPU away for a bit if we are a vCPU, e.g. to
+   let a preempted lock holder run */
+void		bmk_platform_cpu_yield(void);
 
 bmk_time_t	bmk_platform_cpu_clock_monotonic(void);
 bmk_time_t	bmk_platform_cpu_clock_epochoffset(void);
@@ -43,4 +46,21 @@ void		bmk_platform_splx(unsigned long);
 
 void		bmk_platform_ready(void);
 
+/*
+ * Demand-paged memory.  Reserve returns NULL if the platform does
+ * not support it; reserved memory reads as zero until written.
+ * Guard pages work on both reserved and wired memory, platforms
+ * without them return nonzero.  Commit backs reserved memory up
+ * front, for memory which must not fault, such as thread stacks.
+ * The scheduler calls vmem_idle from the idle loop so that a CPU
+ * with nothing to run does not hold up freeing unmapped pages.
+ */
+void *		bmk_platform_vmem_reserve(unsigned long);
+int		bmk_platform_vmem_release(void *, unsigned long);
+void		bmk_platform_vmem_discard(void *, unsigned long);
+int		bmk_platform_vmem_resident(void *);
+int		bmk_platform_vmem_commit(void *, unsigned long);
+void		bmk_platform_vmem_idle(void);
+int		bmk_platform_guard(void *, unsigned long, int);
+
 #endif /* _BMK_CORE_PLATFORM_H_ */
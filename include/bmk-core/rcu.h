@@ -0,0 +1,72 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BMK_CORE_RCU_H_
+#define _BMK_CORE_RCU_H_
+
+/*
+ * Quiescent-state based reclamation.  Threads are never preempted,
+ * so a CPU which passes through the scheduler holds no references
+ * obtained inside a read section.  Read sections therefore cost
+ * nothing, but they must not block.
+ *
+ * Writers unlink an object and hand it to bmk_rcu_call(), which runs
+ * the callback once every CPU has passed through the scheduler.
+ * Callbacks run from the scheduler on the CPU which queued them and
+ * must not block either.  A thread looping for long without
+ * blocking should call bmk_rcu_quiescent() now and then.
+ */
+
+struct bmk_rcu_head {
+	struct bmk_rcu_head *rh_next;
+	void (*rh_func)(struct bmk_rcu_head *);
+	unsigned long rh_gp;
+};
+
+static inline void
+bmk_rcu_read_lock(void)
+{
+
+	__asm__ __volatile__("" ::: "memory");
+}
+
+static inline void
+bmk_rcu_read_unlock(void)
+{
+
+	__asm__ __volatile__("" ::: "memory");
+}
+
+#define bmk_rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define bmk_rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void	bmk_rcu_call(struct bmk_rcu_head *, void (*)(struct bmk_rcu_head *));
+void	bmk_rcu_synchronize(void);
+void	bmk_rcu_quiescent(void);
+
+/* for the scheduler */
+void	bmk_rcu_process(void);
+
+#endif /* _BMK_CORE_RCU_H_ */
@@ -39,10 +39,19 @@ struct bmk_tcb {
 #endif
 };
 
-#define BMK_MAX_THREADS_ORDER	15
+/*
+ * Bounds only.  The ring sizes are decided in bmk_sched_init() from
+ * memory size (or BMK_SCHED_THREADS_ORDER if defined), and thread and
+ * block queue node arrays are grown in chunks up to those limits.
+ * Unless raised with bmk_sched_setmaxthreads(), no more than
+ * 1 << BMK_MIN_THREADS_ORDER threads are created.
+ */
+#define BMK_MIN_THREADS_ORDER	15
+#define BMK_MAX_THREADS_ORDER	18
 #define BMK_MAX_THREADS		(1UL << BMK_MAX_THREADS_ORDER)
 
-#define BMK_MAX_BLOCKQ_ORDER	17 /* >= BMK_MAX_THREADS_ORDER */
+#define BMK_BLOCKQ_EXTRA_ORDER	2
+#define BMK_MAX_BLOCKQ_ORDER	(BMK_MAX_THREADS_ORDER + BMK_BLOCKQ_EXTRA_ORDER)
 #define BMK_MAX_BLOCKQ		(1UL << BMK_MAX_BLOCKQ_ORDER)
 
 struct bmk_thread;
@@ -58,6 +67,11 @@ void	bmk_sched_startmain(void (*)(void *), void *)
 void	bmk_sched_yield(void);
 
 void	bmk_sched_dumpqueue(void);
+void	bmk_sched_trace(int);
+void	bmk_sched_dumptrace(void);
+
+unsigned long	bmk_sched_maxthreads(void);
+unsigned long	bmk_sched_setmaxthreads(unsigned long);
 
 struct bmk_thread *bmk_sched_create(const char *, void *, int,
 				    int, void (*)(void *), void *,
@@ -76,7 +90,12 @@ void	bmk_sched_blockprepare_timeout(bmk_time_t,
 int	bmk_sched_block(struct bmk_block_data *);
 
 void	bmk_sched_wake(struct bmk_thread *);
+void	bmk_sched_wake_handoff(struct bmk_thread *);
+int	bmk_sched_wake_and_switch(struct bmk_thread *,
+				  struct bmk_block_data *);
 void	bmk_sched_wake_timeq(struct bmk_thread *);
+int	bmk_sched_cancel_timeq(struct bmk_thread *);
+int	bmk_sched_oncpu(struct bmk_thread *);
 
 void	bmk_insert_timeq(struct bmk_thread *);
 
@@ -114,6 +133,8 @@ struct bmk_block_queue {
 
 void	bmk_block_queue_init(struct bmk_block_queue *);
 void	bmk_block_queue_destroy(struct bmk_block_queue *);
+void	bmk_block_queue_insert(struct bmk_block_queue *,
+				struct bmk_thread *);
 void	bmk_block_queue_wake(struct bmk_block_queue *);
 
 #endif /* _BMK_CORE_SCHED_H_ */
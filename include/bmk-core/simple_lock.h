@@ -1,28 +1,119 @@
 #pragma once
 
 #include <bmk-pcpu/pcpu.h>
+#include <bmk-core/lockstat.h>
+#include <bmk-core/platform.h>
+
+/*
+ * Spinlocks.  The flavour is chosen per lock when it is initialised:
+ * test-and-set by default, a FIFO ticket lock for contended locks
+ * where waiters would otherwise keep stealing the line from each
+ * other, and optionally paravirt-aware, which gives the physical CPU
+ * back to the hypervisor after spinning for long since the holder is
+ * then likely a preempted vCPU.
+ */
+#define BMK_SIMPLE_LOCK_TICKET	0x1
+#define BMK_SIMPLE_LOCK_PV	0x2
+
+/* rump kernel code cannot call into bmk directly */
+#ifdef _KERNEL
+#define bmk_spin_pv_yield() do { } while (0)
+#else
+#define bmk_spin_pv_yield() bmk_platform_cpu_yield()
+#endif
+
+/*
+ * One step of a loop waiting for another CPU.  Every BMK_SPIN_YIELD
+ * steps the vCPU is given away, as whoever we wait for has then
+ * likely been preempted by the hypervisor.  A yielding vCPU stays
+ * runnable, so releasers need not kick it.
+ */
+#define BMK_SPIN_YIELD	1024
+
+static inline void bmk_spin_wait(unsigned long * spins)
+{
+	bmk_cpu_relax();
+	if (++*spins == BMK_SPIN_YIELD) {
+		*spins = 0;
+		bmk_spin_pv_yield();
+	}
+}
 
 typedef struct bmk_simple_lock_s {
+	/* lock word, or the ticket being served */
 	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) long spinlock;
+	unsigned long next;
+	unsigned long flags;
+#ifdef BMK_LOCKSTAT
+	struct bmk_lockstat_hold lockstat;
+#endif
 	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
 } bmk_simple_lock_t;
 
 #define BMK_SIMPLE_LOCK_INITIALIZER { 0 }
+#define BMK_SIMPLE_LOCK_INITIALIZER_FLAGS(f) { .flags = (f) }
 
-static inline void bmk_simple_lock_init(bmk_simple_lock_t * lock)
+static inline void bmk_simple_lock_init_flags(bmk_simple_lock_t * lock,
+	unsigned long flags)
 {
 	lock->spinlock = 0;
+	lock->next = 0;
+	lock->flags = flags;
+#ifdef BMK_LOCKSTAT
+	lock->lockstat.lh_ent = 0;
+#endif
+}
+
+static inline void bmk_simple_lock_init(bmk_simple_lock_t * lock)
+{
+	bmk_simple_lock_init_flags(lock, 0);
+}
+
+static inline void bmk_simple_lock_spin(bmk_simple_lock_t * lock,
+	unsigned long * spins)
+{
+	if (lock->flags & BMK_SIMPLE_LOCK_PV)
+		bmk_spin_wait(spins);
+	else
+		bmk_cpu_relax();
 }
 
 static inline void bmk_simple_lock_enter(bmk_simple_lock_t * lock)
 {
-	do {
-		while (__atomic_load_n(&lock->spinlock, __ATOMIC_ACQUIRE))
-			bmk_cpu_relax();
-	} while (__atomic_exchange_n(&lock->spinlock, 1, __ATOMIC_SEQ_CST));
+	unsigned long ticket, spins = 0;
+	BMK_LOCKSTAT_TIMER(wait);
+
+	if (lock->flags & BMK_SIMPLE_LOCK_TICKET) {
+		ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+		if ((unsigned long) __atomic_load_n(&lock->spinlock,
+		    __ATOMIC_ACQUIRE) != ticket) {
+			BMK_LOCKSTAT_START(wait);
+			while ((unsigned long) __atomic_load_n(&lock->spinlock,
+			    __ATOMIC_ACQUIRE) != ticket)
+				bmk_simple_lock_spin(lock, &spins);
+			BMK_LOCKSTAT_STOP(wait);
+		}
+	} else if (__atomic_load_n(&lock->spinlock, __ATOMIC_ACQUIRE)
+	    || __atomic_exchange_n(&lock->spinlock, 1, __ATOMIC_SEQ_CST)) {
+		BMK_LOCKSTAT_START(wait);
+		do {
+			while (__atomic_load_n(&lock->spinlock,
+			    __ATOMIC_ACQUIRE))
+				bmk_simple_lock_spin(lock, &spins);
+		} while (__atomic_exchange_n(&lock->spinlock, 1,
+		    __ATOMIC_SEQ_CST));
+		BMK_LOCKSTAT_STOP(wait);
+	}
+	BMK_LOCKSTAT_ACQUIRED(&lock->lockstat, lock, BMK_LOCKSTAT_SPIN,
+	    wait, BMK_LOCKSTAT_HERE());
 }
 
 static inline void bmk_simple_lock_exit(bmk_simple_lock_t * lock)
 {
-	__atomic_store_n(&lock->spinlock, 0, __ATOMIC_SEQ_CST);
+	BMK_LOCKSTAT_RELEASED(&lock->lockstat);
+	if (lock->flags & BMK_SIMPLE_LOCK_TICKET)
+		__atomic_store_n(&lock->spinlock, lock->spinlock + 1,
+		    __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&lock->spinlock, 0, __ATOMIC_SEQ_CST);
 }
@@ -48,4 +48,7 @@ struct rumprun_exec {
 TAILQ_HEAD(rumprun_execs, rumprun_exec);
 extern struct rumprun_execs rumprun_execs;
 
+/* print memory statistics at shutdown, set by "memstats" */
+extern int rumprun_memstats;
+
 #endif /* _BMKCOMMON_RUMPRUN_CONFIG_H_ */
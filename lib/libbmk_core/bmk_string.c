@@ -95,10 +95,38 @@ bmk_strncpy(char *d, const char *s, unsigned long n)
 	return orig;
 }
 
+#ifdef __i386__
+# define NETDOM_MOVS "movsd"
+# define NETDOM_STOS "stosl"
+#elif __x86_64__
+# define NETDOM_MOVS "movsq"
+# define NETDOM_STOS "stosq"
+#endif
+
 void *
 bmk_memset(void *b, int c, unsigned long n)
 {
 	unsigned char *v = b;
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned long units, pattern;
+
+	/* fill a word at a time, this is what zeroes pages */
+	if (n >= 48) {
+		while ((unsigned long) v & (sizeof(unsigned long) - 1)) {
+			*v++ = (unsigned char)c;
+			n--;
+		}
+		pattern = (unsigned char)c * (~0UL / 0xff);
+		units = n / sizeof(unsigned long);
+		__asm__ __volatile__ (
+			"rep " NETDOM_STOS
+			: "+D" (v), "+c" (units)
+			: "a" (pattern)
+			: "cc", "memory"
+		);
+		n &= sizeof(unsigned long) - 1;
+	}
+#endif
 
 	while (n--)
 		*v++ = (unsigned char)c;
@@ -106,12 +134,6 @@ bmk_memset(void *b, int c, unsigned long n)
 	return b;
 }
 
-#ifdef __i386__
-# define NETDOM_MOVS "movsd"
-#elif __x86_64__
-# define NETDOM_MOVS "movsq"
-#endif
-
 void *
 bmk_mempcpy(void *d, const void *src, unsigned long n)
 {
@@ -0,0 +1,242 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock profiling, see <bmk-core/lockstat.h>.
+ *
+ * Entries are keyed by lock address and call site and live in a
+ * fixed open-addressed table.  This is called from within simple
+ * locks, so the table itself is lock-free: an entry is claimed by
+ * moving it from LE_FREE to LE_BUSY and published as LE_READY.
+ * Counters are updated with relaxed atomics, which is precise enough
+ * for ranking.  Hold times are charged to the acquiring call site.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/lockstat.h>
+#include <bmk-core/null.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/printf.h>
+#include <bmk-core/string.h>
+
+#ifdef BMK_LOCKSTAT
+
+#define LOCKSTAT_NENTS		512
+#define LOCKSTAT_NDUMP		32
+
+/* bucket 0 is below 2^LOCKSTAT_HISTSHIFT ns, each next one doubles */
+#define LOCKSTAT_NHIST		16
+#define LOCKSTAT_HISTSHIFT	7
+
+#define LE_FREE		0
+#define LE_BUSY		1
+#define LE_READY	2
+
+struct bmk_lockstat_ent {
+	unsigned int le_state;
+	enum bmk_lockstat_kind le_kind;
+	const void *le_lock;
+	void *le_pc;
+	unsigned long le_nacquire;
+	unsigned long le_ncontended;
+	unsigned long le_waittime;
+	unsigned long le_holdtime;
+	unsigned long le_holdmax;
+	unsigned long le_hist[LOCKSTAT_NHIST];
+};
+
+static struct bmk_lockstat_ent lockstat_ents[LOCKSTAT_NENTS];
+static unsigned long lockstat_lost;
+int bmk_lockstat_on;
+
+bmk_time_t
+bmk_lockstat_now(void)
+{
+
+	return bmk_platform_cpu_clock_monotonic();
+}
+
+static struct bmk_lockstat_ent *
+lockstat_lookup(const void *lock, void *pc, enum bmk_lockstat_kind kind)
+{
+	struct bmk_lockstat_ent *le;
+	unsigned int h, i, state;
+
+	h = (((unsigned long)lock ^ (unsigned long)pc) >> 3) * 2654435761U;
+	for (i = 0; i < LOCKSTAT_NENTS; i++) {
+		le = &lockstat_ents[(h + i) % LOCKSTAT_NENTS];
+		state = __atomic_load_n(&le->le_state, __ATOMIC_ACQUIRE);
+		if (state == LE_FREE && __atomic_compare_exchange_n(
+		    &le->le_state, &state, LE_BUSY, 0,
+		    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			le->le_lock = lock;
+			le->le_pc = pc;
+			le->le_kind = kind;
+			__atomic_store_n(&le->le_state, LE_READY,
+			    __ATOMIC_RELEASE);
+			return le;
+		}
+		while (state == LE_BUSY) {
+			bmk_cpu_relax();
+			state = __atomic_load_n(&le->le_state,
+			    __ATOMIC_ACQUIRE);
+		}
+		if (le->le_lock == lock && le->le_pc == pc)
+			return le;
+	}
+	__atomic_add_fetch(&lockstat_lost, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* wait is zero if the lock was free, else the time waited plus one */
+void
+bmk_lockstat_acquired(struct bmk_lockstat_hold *lh, const void *lock,
+	enum bmk_lockstat_kind kind, bmk_time_t wait, void *pc)
+{
+	struct bmk_lockstat_ent *le;
+
+	if ((le = lockstat_lookup(lock, pc, kind)) == NULL) {
+		lh->lh_ent = NULL;
+		return;
+	}
+	__atomic_add_fetch(&le->le_nacquire, 1, __ATOMIC_RELAXED);
+	if (wait != 0) {
+		__atomic_add_fetch(&le->le_ncontended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&le->le_waittime, wait - 1,
+		    __ATOMIC_RELAXED);
+	}
+	lh->lh_stamp = bmk_lockstat_now();
+	lh->lh_ent = le;
+}
+
+void
+bmk_lockstat_released(struct bmk_lockstat_hold *lh)
+{
+	struct bmk_lockstat_ent *le = lh->lh_ent;
+	unsigned long hold, max;
+	unsigned int b;
+
+	hold = bmk_lockstat_now() - lh->lh_stamp;
+	lh->lh_ent = NULL;
+
+	__atomic_add_fetch(&le->le_holdtime, hold, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&le->le_holdmax, __ATOMIC_RELAXED);
+	while (hold > max && !__atomic_compare_exchange_n(&le->le_holdmax,
+	    &max, hold, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+
+	b = 0;
+	if ((hold >> LOCKSTAT_HISTSHIFT) != 0)
+		b = 8*sizeof(hold) - __builtin_clzl(hold >> LOCKSTAT_HISTSHIFT);
+	if (b >= LOCKSTAT_NHIST)
+		b = LOCKSTAT_NHIST-1;
+	__atomic_add_fetch(&le->le_hist[b], 1, __ATOMIC_RELAXED);
+}
+
+/* set once lockstat has been turned on, see bmk_lockstat_dump() */
+static int lockstat_used;
+
+void
+bmk_lockstat_enable(int enable)
+{
+
+	if (enable)
+		lockstat_used = 1;
+	__atomic_store_n(&bmk_lockstat_on, enable, __ATOMIC_RELEASE);
+}
+
+/*
+ * Print the LOCKSTAT_NDUMP entries with the most time spent waiting,
+ * each followed by its hold time histogram.  Prints nothing if lockstat
+ * was never turned on.
+ */
+void
+bmk_lockstat_dump(void)
+{
+	static const char *kindname[] = { "spin", "mutex" };
+	unsigned char shown[LOCKSTAT_NENTS];
+	struct bmk_lockstat_ent *le, *top;
+	unsigned int i, n, b;
+
+	if (!lockstat_used)
+		return;
+
+	bmk_memset(shown, 0, sizeof(shown));
+	bmk_printf("lockstat: %lu entries lost\n", lockstat_lost);
+	bmk_printf("%-5s %18s %18s %10s %10s %12s %10s %10s\n", "kind",
+	    "lock", "site", "acquired", "contended", "wait us",
+	    "hold avg", "hold max");
+	for (n = 0; n < LOCKSTAT_NDUMP; n++) {
+		top = NULL;
+		for (i = 0; i < LOCKSTAT_NENTS; i++) {
+			le = &lockstat_ents[i];
+			if (shown[i] || __atomic_load_n(&le->le_state,
+			    __ATOMIC_ACQUIRE) != LE_READY)
+				continue;
+			if (top == NULL || le->le_waittime > top->le_waittime
+			    || (le->le_waittime == top->le_waittime
+			      && le->le_nacquire > top->le_nacquire))
+				top = le;
+		}
+		if (top == NULL)
+			break;
+		shown[top - lockstat_ents] = 1;
+
+		bmk_printf("%-5s %18p %18p %10lu %10lu %12lu %10lu %10lu\n",
+		    kindname[top->le_kind], top->le_lock, top->le_pc,
+		    top->le_nacquire, top->le_ncontended,
+		    top->le_waittime / 1000,
+		    top->le_nacquire ? top->le_holdtime / top->le_nacquire : 0,
+		    top->le_holdmax);
+		bmk_printf("\thold ns:");
+		for (b = 0; b < LOCKSTAT_NHIST; b++) {
+			if (top->le_hist[b] == 0)
+				continue;
+			bmk_printf(" %s%lu:%lu", b == 0 ? "<" : ">=",
+			    1UL << (LOCKSTAT_HISTSHIFT + (b ? b-1 : 0)),
+			    top->le_hist[b]);
+		}
+		bmk_printf("\n");
+	}
+}
+
+#else /* !BMK_LOCKSTAT */
+
+void
+bmk_lockstat_enable(int enable)
+{
+
+	if (enable)
+		bmk_printf("lockstat: not compiled in, define BMK_LOCKSTAT\n");
+}
+
+/* bmk_lockstat_enable() already complained */
+void
+bmk_lockstat_dump(void)
+{
+
+}
+
+#endif /* BMK_LOCKSTAT */
@@ -87,11 +87,99 @@ static struct freebucket freebuckets[LOCALBUCKETS];
  * for a given block size.
  */
 static unsigned nmalloc[LOCALBUCKETS];
+static unsigned nmalloc_peak[LOCALBUCKETS];
 
-static bmk_simple_lock_t malloc_slock = BMK_SIMPLE_LOCK_INITIALIZER;
+static bmk_simple_lock_t malloc_slock =
+    BMK_SIMPLE_LOCK_INITIALIZER_FLAGS(BMK_SIMPLE_LOCK_PV);
 #define malloc_lock()	bmk_simple_lock_enter(&malloc_slock)
 #define malloc_unlock()	bmk_simple_lock_exit(&malloc_slock)
 
+/*
+ * Per-CPU magazines in front of the buckets.  Blocks move between
+ * a magazine and the global freelists in batches of half a magazine,
+ * so malloc_slock is taken once per batch instead of once per block.
+ * A magazine holds at most MAGBYTES worth of blocks, which bounds the
+ * memory a CPU can hold on to.  Magazines are only used from thread
+ * context, which is never preempted, so they need no locking.
+ *
+ * nmalloc[] counts blocks taken out of the global freelists, so it
+ * includes blocks sitting in magazines.
+ */
+#define MAGMAX 32
+#define MAGBYTES 16384
+
+struct memalloc_mag {
+	unsigned mm_count;
+	void *mm_objs[MAGMAX];
+};
+
+struct memalloc_cache {
+	struct memalloc_mag mc_mags[LOCALBUCKETS];
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+static struct memalloc_cache memalloc_cache[BMK_CORE_MAXCPUS];
+
+static inline unsigned
+maglimit(unsigned bucket)
+{
+	unsigned n = MAGBYTES >> (bucket+MINSHIFT);
+
+	return n > MAGMAX ? MAGMAX : n;
+}
+
+static inline struct memalloc_mag *
+memalloc_mag(unsigned bucket)
+{
+	return &memalloc_cache[bmk_get_cpu_info()->cpu].mc_mags[bucket];
+}
+
+static void *morecore(int);
+
+/* Fill half of an empty magazine from the freelist. */
+static unsigned
+magrefill(struct memalloc_mag *mag, unsigned bucket)
+{
+	struct memalloc_freeblk *frb;
+	unsigned n = maglimit(bucket) / 2;
+
+	malloc_lock();
+	while (mag->mm_count < n) {
+		if ((frb = LIST_FIRST(&freebuckets[bucket])) == NULL) {
+			/*
+			 * If nothing in hash bucket right now,
+			 * request more memory from the system.
+			 */
+			if ((frb = morecore(bucket)) == NULL)
+				break;
+		} else {
+			LIST_REMOVE(frb, entries);
+		}
+		mag->mm_objs[mag->mm_count++] = frb;
+	}
+	nmalloc[bucket] += mag->mm_count;
+	if (nmalloc[bucket] > nmalloc_peak[bucket])
+		nmalloc_peak[bucket] = nmalloc[bucket];
+	malloc_unlock();
+
+	return mag->mm_count;
+}
+
+/* Return half of a full magazine to the freelist. */
+static void
+magflush(struct memalloc_mag *mag, unsigned bucket)
+{
+	struct memalloc_freeblk *frb;
+	unsigned n = maglimit(bucket) / 2;
+
+	malloc_lock();
+	nmalloc[bucket] -= mag->mm_count - n;
+	while (mag->mm_count > n) {
+		frb = mag->mm_objs[--mag->mm_count];
+		LIST_INSERT_HEAD(&freebuckets[bucket], frb, entries);
+	}
+	malloc_unlock();
+}
+
 static void *
 morecore(int bucket)
 {
@@ -135,31 +223,245 @@ bmk_memalloc_init(void)
 static void *
 bucketalloc(unsigned bucket)
 {
-	struct memalloc_freeblk *frb;
+	struct memalloc_mag *mag = memalloc_mag(bucket);
 
-	malloc_lock();
+	if (mag->mm_count == 0 && magrefill(mag, bucket) == 0)
+		return NULL;
+	return mag->mm_objs[--mag->mm_count];
+}
 
-	/*
-	 * If nothing in hash bucket right now,
-	 * request more memory from the system.
-	 */
-	if ((frb = LIST_FIRST(&freebuckets[bucket])) == NULL) {
-		if ((frb = morecore(bucket)) == NULL) {
-			malloc_unlock();
-			return NULL;
+static void
+bucketfree(void *frb, unsigned bucket)
+{
+	struct memalloc_mag *mag = memalloc_mag(bucket);
+
+	if (mag->mm_count == maglimit(bucket))
+		magflush(mag, bucket);
+	mag->mm_objs[mag->mm_count++] = frb;
+}
+
+/*
+ * Per-owner accounting.  Counters are kept per CPU and a CPU's
+ * byte count is folded into the global one once it has moved by
+ * MEMSTAT_BATCH, so the peak is exact to within that much per CPU.
+ * Like the magazines, the per-CPU part needs no locking.
+ *
+ * If sampling is enabled, every memstat_interval'th allocation on
+ * a CPU records its call site.  Frees are not matched to call sites,
+ * so the histogram shows who allocates most, not who holds most.
+ */
+#define MEMSTAT_BATCH (64*1024)
+#define MEMSTAT_NCALLERS 256
+
+struct memstat_cpu {
+	long msc_delta[BMK_MEMWHO_NUM];
+	unsigned long msc_nalloc[BMK_MEMWHO_NUM];
+	unsigned long msc_nfree[BMK_MEMWHO_NUM];
+	unsigned int msc_sample;
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+static struct memstat_cpu memstat_cpu[BMK_CORE_MAXCPUS];
+
+static struct {
+	long ms_inuse;
+	long ms_peak;
+	unsigned long ms_lastnalloc;
+} memstat[BMK_MEMWHO_NUM];
+static bmk_time_t memstat_lastprint;
+
+struct memstat_caller {
+	void *mc_pc;
+	unsigned long mc_count;
+	unsigned long mc_bytes;
+	enum bmk_memwho mc_who;
+};
+static struct memstat_caller memstat_callers[MEMSTAT_NCALLERS];
+static unsigned long memstat_lost;
+static unsigned int memstat_interval;
+static bmk_simple_lock_t memstat_slock = BMK_SIMPLE_LOCK_INITIALIZER;
+
+static void
+memstat_fold(struct memstat_cpu *msc, enum bmk_memwho who)
+{
+	long v, peak;
+
+	v = __atomic_add_fetch(&memstat[who].ms_inuse, msc->msc_delta[who],
+	    __ATOMIC_RELAXED);
+	msc->msc_delta[who] = 0;
+	peak = __atomic_load_n(&memstat[who].ms_peak, __ATOMIC_RELAXED);
+	while (v > peak && !__atomic_compare_exchange_n(&memstat[who].ms_peak,
+	    &peak, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+static void
+memstat_add(enum bmk_memwho who, long nbytes)
+{
+	struct memstat_cpu *msc = &memstat_cpu[bmk_get_cpu_info()->cpu];
+
+	msc->msc_delta[who] += nbytes;
+	if (msc->msc_delta[who] >= MEMSTAT_BATCH
+	    || msc->msc_delta[who] <= -MEMSTAT_BATCH)
+		memstat_fold(msc, who);
+}
+
+void
+bmk_memstat_alloc(enum bmk_memwho who, unsigned long nbytes)
+{
+
+	memstat_cpu[bmk_get_cpu_info()->cpu].msc_nalloc[who]++;
+	memstat_add(who, nbytes);
+}
+
+void
+bmk_memstat_free(enum bmk_memwho who, unsigned long nbytes)
+{
+
+	memstat_cpu[bmk_get_cpu_info()->cpu].msc_nfree[who]++;
+	memstat_add(who, -(long)nbytes);
+}
+
+/*
+ * Record every interval'th allocation's call site, or stop sampling
+ * if interval is 0.  The histogram is cleared.
+ */
+void
+bmk_memstat_setsampling(unsigned int interval)
+{
+
+	bmk_simple_lock_enter(&memstat_slock);
+	bmk_memset(memstat_callers, 0, sizeof(memstat_callers));
+	memstat_lost = 0;
+	memstat_interval = interval;
+	bmk_simple_lock_exit(&memstat_slock);
+}
+
+void
+bmk_memstat_sample(enum bmk_memwho who, unsigned long nbytes, void *pc)
+{
+	struct memstat_cpu *msc;
+	struct memstat_caller *mc;
+	unsigned int interval, h, i;
+
+	if ((interval = memstat_interval) == 0)
+		return;
+	msc = &memstat_cpu[bmk_get_cpu_info()->cpu];
+	if (msc->msc_sample-- > 1)
+		return;
+	msc->msc_sample = interval;
+
+	h = ((unsigned long)pc >> 2) * 2654435761U;
+	bmk_simple_lock_enter(&memstat_slock);
+	for (i = 0; i < MEMSTAT_NCALLERS; i++) {
+		mc = &memstat_callers[(h + i) % MEMSTAT_NCALLERS];
+		if (mc->mc_pc == NULL) {
+			mc->mc_pc = pc;
+			mc->mc_who = who;
+		}
+		if (mc->mc_pc == pc) {
+			mc->mc_count++;
+			mc->mc_bytes += nbytes;
+			break;
 		}
-	} else {
-		LIST_REMOVE(frb, entries);
 	}
+	if (i == MEMSTAT_NCALLERS)
+		memstat_lost++;
+	bmk_simple_lock_exit(&memstat_slock);
+}
 
-	nmalloc[bucket]++;
-	malloc_unlock();
+static void
+memstat_printstats(void)
+{
+	static const char *whoname[BMK_MEMWHO_NUM] = {
+		"wiredbmk", "rumpkern", "user"
+	};
+	struct memstat_caller *mc, *top;
+	unsigned long nalloc, nfree, cpu;
+	bmk_time_t now, elapsed;
+	long delta;
+	unsigned int w, i, n;
+
+	now = bmk_platform_cpu_clock_monotonic();
+	elapsed = now - memstat_lastprint;
+	memstat_lastprint = now;
+
+	bmk_printf("%-9s %10s %10s %10s %10s %10s\n", "owner",
+	    "inuse kB", "peak kB", "allocs", "frees", "allocs/s");
+	for (w = 0; w < BMK_MEMWHO_NUM; w++) {
+		nalloc = nfree = 0;
+		delta = 0;
+		for (cpu = 0; cpu < bmk_numcpus && cpu < BMK_CORE_MAXCPUS;
+		    cpu++) {
+			nalloc += memstat_cpu[cpu].msc_nalloc[w];
+			nfree += memstat_cpu[cpu].msc_nfree[w];
+			delta += memstat_cpu[cpu].msc_delta[w];
+		}
+		bmk_printf("%-9s %10ld %10ld %10lu %10lu %10lu\n", whoname[w],
+		    (memstat[w].ms_inuse + delta)/1024,
+		    memstat[w].ms_peak/1024, nalloc, nfree,
+		    elapsed ? (unsigned long)((nalloc - memstat[w].ms_lastnalloc)
+		      * 1000000000ULL / elapsed) : 0);
+		memstat[w].ms_lastnalloc = nalloc;
+	}
 
-	return frb;
+	if (memstat_interval == 0)
+		return;
+
+	/* top call sites by sampled bytes, selection sort is fine here */
+	bmk_simple_lock_enter(&memstat_slock);
+	bmk_printf("sampled call sites (1 in %u allocations, %lu lost):\n",
+	    memstat_interval, memstat_lost);
+	for (n = 0; n < 16; n++) {
+		top = NULL;
+		for (i = 0; i < MEMSTAT_NCALLERS; i++) {
+			mc = &memstat_callers[i];
+			if (mc->mc_pc == NULL || (long)mc->mc_count <= 0)
+				continue;
+			if (top == NULL || mc->mc_bytes > top->mc_bytes)
+				top = mc;
+		}
+		if (top == NULL)
+			break;
+		bmk_printf("\t%p %-9s %8lu samples %10lu kB\n", top->mc_pc,
+		    whoname[top->mc_who], top->mc_count, top->mc_bytes/1024);
+		/* hide from the following rounds, restored below */
+		top->mc_count = -top->mc_count;
+	}
+	for (i = 0; i < MEMSTAT_NCALLERS; i++) {
+		mc = &memstat_callers[i];
+		if ((long)mc->mc_count < 0)
+			mc->mc_count = -mc->mc_count;
+	}
+	bmk_simple_lock_exit(&memstat_slock);
 }
 
-void *
-bmk_memalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who)
+/*
+ * Convert amount of memory requested into closest block size
+ * stored in hash buckets which satisfies request.
+ */
+static unsigned
+size2bucket(unsigned long allocbytes)
+{
+	unsigned bucket;
+
+	if (allocbytes < 1<<MINSHIFT) {
+		bucket = 0;
+	} else {
+		bucket = 8*sizeof(allocbytes)
+		    - __builtin_clzl(allocbytes>>MINSHIFT);
+		if ((allocbytes & (allocbytes-1)) == 0)
+			bucket--;
+	}
+	return bucket;
+}
+
+/*
+ * Allocate, optionally zeroed.  Page-backed blocks come zeroed from
+ * the page allocator, which knows what is zero already.
+ */
+static void *
+memalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who,
+	int zero)
 {
 	struct memalloc_hdr *hdr;
 	void *rv;
@@ -176,23 +478,19 @@ bmk_memalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who)
 	/* need at least this many bytes plus header to satisfy alignment */
 	allocbytes = nbytes + ((sizeof(*hdr) + (align-1)) & ~(align-1));
 
-	/*
-	 * Convert amount of memory requested into closest block size
-	 * stored in hash buckets which satisfies request.
-	 * Account for space used per block for accounting.
-	 */
-	if (allocbytes < 1<<MINSHIFT) {
-		bucket = 0;
-	} else {
-		bucket = 8*sizeof(allocbytes)
-		    - __builtin_clzl(allocbytes>>MINSHIFT);
-		if ((allocbytes & (allocbytes-1)) == 0)
-			bucket--;
-	}
+	/* Account for space used per block for accounting. */
+	bucket = size2bucket(allocbytes);
 
 	/* handle with page allocator? */
 	if (bucket >= LOCALBUCKETS) {
-		hdr = bmk_pgalloc(bucket+MINSHIFT - BMK_PCPU_PAGE_SHIFT);
+		if (zero) {
+			hdr = bmk_pgalloc_zero(bucket+MINSHIFT
+			    - BMK_PCPU_PAGE_SHIFT);
+			zero = 0;
+		} else {
+			hdr = bmk_pgalloc(bucket+MINSHIFT
+			    - BMK_PCPU_PAGE_SHIFT);
+		}
 	} else {
 		hdr = bucketalloc(bucket);
 	}
@@ -213,9 +511,23 @@ bmk_memalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who)
 	hdr->mh_alignpad = alignpad;
 	hdr->mh_who = who;
 
+	if (zero)
+		bmk_memset(rv, 0, nbytes);
+	bmk_memstat_alloc(who, 1UL<<(bucket+MINSHIFT));
+
   	return rv;
 }
 
+void *
+bmk_memalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who)
+{
+
+	/* user allocations are sampled by the libc entry points */
+	if (who != BMK_MEMWHO_USER)
+		bmk_memstat_sample(who, nbytes, __builtin_return_address(0));
+	return memalloc(nbytes, align, who, 0);
+}
+
 void *
 bmk_xmalloc_bmk(unsigned long howmuch)
 {
@@ -230,23 +542,20 @@ bmk_xmalloc_bmk(unsigned long howmuch)
 void *
 bmk_memcalloc(unsigned long n, unsigned long size, enum bmk_memwho who)
 {
-	void *v;
 	unsigned long tot = n * size;
 
 	if (size != 0 && tot / size != n)
 		return NULL;
 
-	if ((v = bmk_memalloc(tot, MINALIGN, who)) != NULL) {
-		bmk_memset(v, 0, tot);
-	}
-	return v;
+	if (who != BMK_MEMWHO_USER)
+		bmk_memstat_sample(who, tot, __builtin_return_address(0));
+	return memalloc(tot, MINALIGN, who, 1);
 }
 
 void
 bmk_memfree(void *cp, enum bmk_memwho who)
 {   
 	struct memalloc_hdr *hdr;
-	struct memalloc_freeblk *frb;
 	unsigned long alignpad;
 	unsigned int index;
 	void *origp;
@@ -286,14 +595,11 @@ bmk_memfree(void *cp, enum bmk_memwho who)
 	}
 #endif
 
+	bmk_memstat_free(who, 1UL<<(index+MINSHIFT));
 	if (index >= LOCALBUCKETS) {
 		bmk_pgfree(origp, (index+MINSHIFT) - BMK_PCPU_PAGE_SHIFT);
 	} else {
-		malloc_lock();
-		frb = origp;
-		LIST_INSERT_HEAD(&freebuckets[index], frb, entries);
-		nmalloc[index]--;
-		malloc_unlock();
+		bucketfree(origp, index);
 	}
 }
 
@@ -330,6 +636,26 @@ bmk_memrealloc_user(void *cp, unsigned long nbytes)
 	if (((1<<(size+MINSHIFT)) - alignpad) >= nbytes)
 		return cp;
 
+	/*
+	 * Page-backed blocks can grow in place if the buddy pages are
+	 * free.  The block must stay aligned to its new size, since it
+	 * will be freed as one buddy chunk.
+	 */
+	if (size >= LOCALBUCKETS) {
+		unsigned nsize = size2bucket(nbytes + alignpad);
+		unsigned long origp = (unsigned long)cp - alignpad;
+
+		if ((origp & ((1UL<<(nsize+MINSHIFT))-1)) == 0
+		    && bmk_pgalloc_tryextend((void *)origp,
+		      1UL<<(size+MINSHIFT-BMK_PCPU_PAGE_SHIFT),
+		      1UL<<(nsize+MINSHIFT-BMK_PCPU_PAGE_SHIFT))) {
+			memstat_add(BMK_MEMWHO_USER, (1L<<(nsize+MINSHIFT))
+			    - (1L<<(size+MINSHIFT)));
+			hdr->mh_index = nsize;
+			return cp;
+		}
+	}
+
 	/* we're gonna need a bigger bucket */
 	np = bmk_memalloc(nbytes, 8, BMK_MEMWHO_USER);
 	if (np == NULL)
@@ -343,16 +669,17 @@ bmk_memrealloc_user(void *cp, unsigned long nbytes)
 /*
  * mstats - print out statistics about malloc
  * 
- * Prints two lines of numbers, one showing the length of the free list
- * for each size category, the second showing the number of mallocs -
- * frees for each size category.
+ * Prints the length of the free list, the peak and current number of
+ * blocks out of the freelists, and the number of blocks in per-CPU
+ * caches for each size category, followed by the per-owner totals.
  */
 void
 bmk_memalloc_printstats(void)
 {
 	struct memalloc_freeblk *frb;
-	unsigned long totfree = 0, totused = 0;
+	unsigned long totfree = 0, totused = 0, totcached = 0;
 	unsigned int i, j;
+	unsigned cached[LOCALBUCKETS];
 
 	bmk_printf("Memory allocation statistics\n");
 	bmk_printf("size:\t");
@@ -368,13 +695,32 @@ bmk_memalloc_printstats(void)
 		bmk_printf("%8d", j);
 		totfree += j * (1 << (i + MINSHIFT));
   	}
+	bmk_printf("\npeak:\t");
+	for (i = 0; i < LOCALBUCKETS; i++) {
+		bmk_printf("%8d", nmalloc_peak[i]);
+	}
+	bmk_printf("\ncached:\t");
+	for (i = 0; i < LOCALBUCKETS; i++) {
+		unsigned long cpu;
+
+		j = 0;
+		for (cpu = 0; cpu < bmk_numcpus && cpu < BMK_CORE_MAXCPUS;
+		    cpu++)
+			j += memalloc_cache[cpu].mc_mags[i].mm_count;
+		bmk_printf("%8d", j);
+		totcached += j * (1 << (i + MINSHIFT));
+		cached[i] = j;
+	}
 	bmk_printf("\nused:\t");
 	for (i = 0; i < LOCALBUCKETS; i++) {
-		bmk_printf("%8d", nmalloc[i]);
-		totused += nmalloc[i] * (1 << (i + MINSHIFT));
+		bmk_printf("%8d", nmalloc[i] - cached[i]);
+		totused += (nmalloc[i] - cached[i]) * (1 << (i + MINSHIFT));
   	}
-	bmk_printf("\n\tTotal in use: %lukB, total free in buckets: %lukB\n",
-	    totused/1024, totfree/1024);
+	bmk_printf("\n\tTotal in use: %lukB, total free in buckets: %lukB, "
+	    "in per-CPU caches: %lukB\n",
+	    totused/1024, totfree/1024, totcached/1024);
+
+	memstat_printstats();
 }
 
 
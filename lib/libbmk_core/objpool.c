@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Fixed-size object pools backed by one preallocated contiguous
+ * range, meant for packet buffers and similar objects which are
+ * allocated and freed at a high rate.  The free objects are kept as
+ * indices in a lock-free ring, fronted by per-CPU magazines which
+ * are refilled and drained half a magazine at a time.  A pool never
+ * grows: when it runs dry, bmk_objpool_get() returns NULL and the
+ * caller falls back to a general purpose allocator.
+ *
+ * Like the other per-CPU caches, magazines are only used from thread
+ * context, which is never preempted, so they need no locking.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/memalloc.h>
+#include <bmk-core/null.h>
+#include <bmk-core/objpool.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/printf.h>
+#include <stddef.h>
+#include <bmk-core/types.h>
+#include <bmk-core/lfring.h>
+
+#include <bmk-pcpu/pcpu.h>
+
+#define OBJPOOL_MAGMAX 32
+
+struct objpool_mag {
+	unsigned int om_count;
+	void *om_objs[OBJPOOL_MAGMAX];
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+
+struct bmk_objpool {
+	char *op_base;
+	unsigned long op_size;
+	unsigned long op_nobjs;
+	size_t op_order;
+	struct lfring *op_ring;
+	unsigned long op_misses;
+	struct objpool_mag op_mags[BMK_CORE_MAXCPUS];
+};
+
+/*
+ * Create a pool of nobjs objects of size bytes on the given node,
+ * or the current CPU's node if node is negative.  Objects are
+ * aligned to the cache line size.
+ */
+struct bmk_objpool *
+bmk_objpool_create(unsigned long size, unsigned long nobjs, int node)
+{
+	struct bmk_objpool *op;
+	unsigned long i;
+
+	bmk_assert(size > 0 && nobjs > 0);
+
+	op = bmk_memcalloc(1, sizeof(*op), BMK_MEMWHO_WIREDBMK);
+	if (op == NULL)
+		return NULL;
+	op->op_size = (size + BMK_PCPU_L1_SIZE-1) & ~(BMK_PCPU_L1_SIZE-1);
+	op->op_nobjs = nobjs;
+	op->op_order = LFRING_MIN;
+	while ((1UL << op->op_order) < nobjs)
+		op->op_order++;
+
+	op->op_ring = bmk_memalloc(LFRING_SIZE(op->op_order), LFRING_ALIGN,
+	    BMK_MEMWHO_WIREDBMK);
+	if (op->op_ring == NULL)
+		goto fail;
+	op->op_base = bmk_pgalloc_huge(op->op_size * nobjs, node);
+	if (op->op_base == NULL)
+		goto fail;
+
+	lfring_init_empty(op->op_ring, op->op_order);
+	for (i = 0; i < nobjs; i++)
+		lfring_enqueue(op->op_ring, op->op_order, i, false);
+	return op;
+
+ fail:
+	bmk_memfree(op->op_ring, BMK_MEMWHO_WIREDBMK);
+	bmk_memfree(op, BMK_MEMWHO_WIREDBMK);
+	return NULL;
+}
+
+static unsigned int
+objpool_refill(struct bmk_objpool *op, struct objpool_mag *om)
+{
+	size_t idx;
+
+	while (om->om_count < OBJPOOL_MAGMAX/2) {
+		idx = lfring_dequeue(op->op_ring, op->op_order, false);
+		if (idx == LFRING_EMPTY)
+			break;
+		om->om_objs[om->om_count++] = op->op_base + idx * op->op_size;
+	}
+	return om->om_count;
+}
+
+void *
+bmk_objpool_get(struct bmk_objpool *op)
+{
+	struct objpool_mag *om = &op->op_mags[bmk_get_cpu_info()->cpu];
+
+	if (om->om_count == 0 && objpool_refill(op, om) == 0) {
+		__atomic_add_fetch(&op->op_misses, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return om->om_objs[--om->om_count];
+}
+
+void
+bmk_objpool_put(struct bmk_objpool *op, void *obj)
+{
+	struct objpool_mag *om = &op->op_mags[bmk_get_cpu_info()->cpu];
+	unsigned long off = (unsigned long)((char *)obj - op->op_base);
+	char *p;
+
+	bmk_assert(off < op->op_size * op->op_nobjs && off % op->op_size == 0);
+
+	if (om->om_count == OBJPOOL_MAGMAX) {
+		while (om->om_count > OBJPOOL_MAGMAX/2) {
+			p = om->om_objs[--om->om_count];
+			lfring_enqueue(op->op_ring, op->op_order,
+			    (p - op->op_base) / op->op_size, false);
+		}
+	}
+	om->om_objs[om->om_count++] = obj;
+}
+
+unsigned long
+bmk_objpool_objsize(struct bmk_objpool *op)
+{
+
+	return op->op_size;
+}
+
+/* Does obj come from the pool?  A NULL pool owns nothing. */
+int
+bmk_objpool_owns(struct bmk_objpool *op, void *obj)
+{
+
+	return op != NULL && (char *)obj >= op->op_base
+	    && (char *)obj < op->op_base + op->op_size * op->op_nobjs;
+}
+
+void
+bmk_objpool_printstats(struct bmk_objpool *op)
+{
+	unsigned long cpu, cached = 0;
+
+	for (cpu = 0; cpu < bmk_numcpus && cpu < BMK_CORE_MAXCPUS; cpu++)
+		cached += op->op_mags[cpu].om_count;
+	bmk_printf("objpool %p: %lu objects of %lu bytes, %lu in per-CPU "
+	    "caches, %lu misses\n", op, op->op_nobjs, op->op_size, cached,
+	    op->op_misses);
+}
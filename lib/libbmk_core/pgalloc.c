@@ -70,6 +70,8 @@
 
 #include <bmk-pcpu/pcpu.h>
 
+#include <stdatomic.h>
+
 #ifndef BMK_PGALLOC_DEBUG
 #define DPRINTF(x)
 #define SANITY_CHECK()
@@ -81,7 +83,8 @@ int bmk_pgalloc_debug = 0;
 
 unsigned long pgalloc_totalkb, pgalloc_usedkb;
 
-static bmk_simple_lock_t pgalloc_slock = BMK_SIMPLE_LOCK_INITIALIZER;
+static bmk_simple_lock_t pgalloc_slock =
+    BMK_SIMPLE_LOCK_INITIALIZER_FLAGS(BMK_SIMPLE_LOCK_PV);
 #define pgalloc_lock()		bmk_simple_lock_enter(&pgalloc_slock)
 #define pgalloc_unlock()	bmk_simple_lock_exit(&pgalloc_slock)
 
@@ -183,6 +186,9 @@ map_free(void *virt, unsigned long nr_pages)
 struct chunk {
 	int level;
 	int magic;
+	int node;
+	int zero;	/* all zero except for this header */
+	unsigned long zeroed;	/* bytes known zero, header included */
 
 	LIST_ENTRY(chunk) entries;
 };
@@ -204,17 +210,78 @@ chunklevel(struct chunk *ch)
  * much space, leave it be for now.
  */
 #define FREELIST_LEVELS (8*(sizeof(void*))-BMK_PCPU_PAGE_SHIFT)
-static LIST_HEAD(, chunk) freelist[FREELIST_LEVELS];
+static LIST_HEAD(, chunk) freelist[BMK_PGALLOC_MAXNODES][FREELIST_LEVELS];
+
+/*
+ * NUMA nodes.  Each node has its own set of freelists, and chunks
+ * never span or coalesce across nodes.  Memory which the platform
+ * did not assign to a node belongs to node 0, and so does every CPU
+ * until told otherwise, so without topology information everything
+ * behaves as a single node.  There is still one lock for all nodes,
+ * since bitmap words may straddle a node boundary.
+ */
+#define MAXRANGES 32
+
+static struct {
+	unsigned long min, max;
+	int node;
+} noderange[MAXRANGES];
+static unsigned int nnoderanges;
+static int nnodes = 1;
+static unsigned char cpunode[BMK_CORE_MAXCPUS];
+
+static int
+addr2node(void *addr)
+{
+	unsigned long p = (unsigned long)addr;
+	unsigned int i;
+
+	for (i = 0; i < nnoderanges; i++) {
+		if (p >= noderange[i].min && p < noderange[i].max)
+			return noderange[i].node;
+	}
+	return 0;
+}
+
+static int
+curnode(void)
+{
+
+	if (nnodes == 1)
+		return 0;
+	return cpunode[bmk_get_cpu_info()->cpu];
+}
+
+/* set when a chunk which is not known to be zero is freed */
+static atomic_int pgzero_dirty;
+
+/* free chunk which the idle loop is clearing, see bmk_pgalloc_idle() */
+static struct chunk *pgzero_cur;
 
 static void
-freechunk_link(void *addr, int order)
+freechunk_link(void *addr, int order, int node, int zero)
 {
 	struct chunk *ch = addr;
 
 	ch->level = order;
 	ch->magic = CHUNKMAGIC;
+	ch->node = node;
+	ch->zero = zero;
+	ch->zeroed = zero ? order2size(order) : sizeof(*ch);
+	if (!zero)
+		atomic_store_explicit(&pgzero_dirty, 1, memory_order_relaxed);
 
-	LIST_INSERT_HEAD(&freelist[order], ch, entries);
+	LIST_INSERT_HEAD(&freelist[node][order], ch, entries);
+}
+
+static void
+freechunk_unlink(struct chunk *ch)
+{
+
+	LIST_REMOVE(ch, entries);
+	ch->magic = 0;
+	if (ch == pgzero_cur)
+		pgzero_cur = NULL;
 }
 
 #ifdef BMK_PGALLOC_DEBUG
@@ -237,50 +304,24 @@ static void
 sanity_check(void)
 {
 	unsigned int x;
+	int n;
 	struct chunk *head;
 
-	for (x = 0; x < FREELIST_LEVELS; x++) {
-		LIST_FOREACH(head, &freelist[x], entries) {
-			bmk_assert(!allocated_in_map(head));
-			bmk_assert(head->magic == CHUNKMAGIC);
+	for (n = 0; n < nnodes; n++) {
+		for (x = 0; x < FREELIST_LEVELS; x++) {
+			LIST_FOREACH(head, &freelist[n][x], entries) {
+				bmk_assert(!allocated_in_map(head));
+				bmk_assert(head->magic == CHUNKMAGIC);
+				bmk_assert(head->node == n);
+				bmk_assert(addr2node(head) == n);
+			}
 		}
 	}
 }
 #endif
 
-#if 0
-void
-bmk_pgalloc_dumpstats(void)
-{
-	struct chunk *ch;
-	unsigned long remainingkb;
-	unsigned i;
-
-	remainingkb = pgalloc_totalkb - pgalloc_usedkb;
-	bmk_printf("pgalloc total %ld kB, used %ld kB (remaining %ld kB)\n",
-	    pgalloc_totalkb, pgalloc_usedkb, remainingkb);
-
-	bmk_printf("available chunks:\n");
-	for (i = 0; i < FREELIST_LEVELS; i++) {
-		unsigned long chunks, levelhas;
-
-		if (LIST_EMPTY(&freelist[i]))
-			continue;
-
-		chunks = 0;
-		LIST_FOREACH(ch, &freelist[i], entries) {
-			chunks++;
-		}
-		levelhas = chunks * (order2size(i)>>10);
-		bmk_printf("%8ld kB: %8ld chunks, %12ld kB\t(%2ld%%)\n",
-		    order2size(i)>>10, chunks, levelhas,
-		    (100*levelhas)/remainingkb);
-	}
-}
-#endif
-
 static void
-carverange(unsigned long addr, unsigned long range)
+carverange(unsigned long addr, unsigned long range, int node, int zero)
 {
 	struct chunk *ch;
 	unsigned i, r;
@@ -298,7 +339,7 @@ carverange(unsigned long addr, unsigned long range)
 		i -= BMK_PCPU_PAGE_SHIFT;
 
 		ch = addr2chunk(addr, 0);
-		freechunk_link(ch, i);
+		freechunk_link(ch, i, node, zero);
 		addr += order2size(i);
 		range -= order2size(i);
 
@@ -330,7 +371,10 @@ bmk_pgalloc_loadmem(unsigned long min, unsigned long max)
 	    min, max));
 
 	for (i = 0; i < FREELIST_LEVELS; i++) {
-		LIST_INIT(&freelist[i]);
+		int n;
+
+		for (n = 0; n < BMK_PGALLOC_MAXNODES; n++)
+			LIST_INIT(&freelist[n][i]);
 	}
 
 	/* Allocate space for the allocation bitmap. */
@@ -351,17 +395,128 @@ bmk_pgalloc_loadmem(unsigned long min, unsigned long max)
 	/* Free up the memory we've been given to play with. */
 	map_free((void *)min, range>>BMK_PCPU_PAGE_SHIFT);
 
-	carverange(min, range);
+	carverange(min, range, 0, 0);
+}
+
+/*
+ * Assign [min,max) to node.  Free memory in the range is moved over
+ * from node 0 right away, so this is meant to be called at boot right
+ * after bmk_pgalloc_loadmem(), before there is much allocated.
+ */
+void
+bmk_pgalloc_loadnode(int node, unsigned long min, unsigned long max)
+{
+	struct chunk *ch, *next;
+	unsigned long start, end, cmin, cmax;
+	unsigned int i;
+	int zero;
+
+	bmk_assert(node >= 0 && node < BMK_PGALLOC_MAXNODES);
+
+	min = bmk_round_page(min);
+	max = bmk_trunc_page(max);
+	if (min < (unsigned long)minpage_addr)
+		min = (unsigned long)minpage_addr;
+	if (max > (unsigned long)maxpage_addr)
+		max = (unsigned long)maxpage_addr;
+	if (min >= max)
+		return;
+
+	pgalloc_lock();
+	if (nnoderanges == MAXRANGES) {
+		pgalloc_unlock();
+		bmk_printf("pgalloc: too many node ranges, ignoring "
+		    "[0x%lx,0x%lx)\n", min, max);
+		return;
+	}
+	noderange[nnoderanges].min = min;
+	noderange[nnoderanges].max = max;
+	noderange[nnoderanges].node = node;
+	nnoderanges++;
+	if (node >= nnodes)
+		nnodes = node + 1;
+	if (node == 0) {
+		pgalloc_unlock();
+		return;
+	}
+
+	/*
+	 * Recarve node 0 chunks overlapping the range.  Pieces left
+	 * outside of it go back to node 0 at lower levels, which the
+	 * walk then sees again, but they no longer overlap.
+	 */
+	for (i = FREELIST_LEVELS; i-- > 0; ) {
+		LIST_FOREACH_SAFE(ch, &freelist[0][i], entries, next) {
+			cmin = (unsigned long)ch;
+			cmax = cmin + order2size(i);
+			if (cmax <= min || cmin >= max)
+				continue;
+
+			freechunk_unlink(ch);
+			zero = ch->zero;
+			start = cmin < min ? min : cmin;
+			end = cmax > max ? max : cmax;
+			if (cmin < start)
+				carverange(cmin, start - cmin, 0, zero);
+			carverange(start, end - start, node, zero);
+			if (end < cmax)
+				carverange(end, cmax - end, 0, zero);
+		}
+	}
+	SANITY_CHECK();
+	pgalloc_unlock();
+}
+
+void
+bmk_pgalloc_setcpunode(unsigned long cpu, int node)
+{
+
+	bmk_assert(cpu < BMK_CORE_MAXCPUS);
+	bmk_assert(node >= 0 && node < nnodes);
+	cpunode[cpu] = node;
+}
+
+int
+bmk_pgalloc_cpunode(unsigned long cpu)
+{
+
+	bmk_assert(cpu < BMK_CORE_MAXCPUS);
+	return cpunode[cpu];
+}
+
+int
+bmk_pgalloc_addrnode(void *addr)
+{
+
+	if (nnodes == 1)
+		return 0;
+	return addr2node(addr);
+}
+
+/* Range of addresses pages are handed out from. */
+void
+bmk_pgalloc_bounds(unsigned long *min, unsigned long *max)
+{
+
+	*min = (unsigned long)minpage_addr;
+	*max = (unsigned long)maxpage_addr;
+}
+
+int
+bmk_pgalloc_nnodes(void)
+{
+
+	return nnodes;
 }
 
 /* can we allocate for given align from freelist index i? */
 static struct chunk *
-satisfies_p(int i, unsigned long align)
+satisfies_p(int node, int i, unsigned long align)
 {
 	struct chunk *ch;
 	unsigned long p;
 
-	LIST_FOREACH(ch, &freelist[i], entries) {
+	LIST_FOREACH(ch, &freelist[node][i], entries) {
 		p = (unsigned long)ch;
 		if ((p & (align-1)) == 0)
 			return ch;
@@ -373,35 +528,44 @@ satisfies_p(int i, unsigned long align)
 void *
 bmk_pgalloc(int order)
 {
-	return bmk_pgalloc_align(order, BMK_PCPU_PAGE_SIZE);
+	return bmk_pgalloc_align_node(order, BMK_PCPU_PAGE_SIZE, -1);
 }
 
 void *
 bmk_pgalloc_align(int order, unsigned long align)
 {
-	struct chunk *alloc_ch;
+	return bmk_pgalloc_align_node(order, align, -1);
+}
+
+void *
+bmk_pgalloc_node(int order, int node)
+{
+	return bmk_pgalloc_align_node(order, BMK_PCPU_PAGE_SIZE, node);
+}
+
+/*
+ * Take a chunk of the given order off node's freelists.  If zerop
+ * is not NULL, it is set to whether the chunk is known to be zero
+ * apart from its first sizeof(struct chunk) bytes.  Called with the
+ * lock held.
+ */
+static void *
+buddy_alloc(int order, unsigned long align, int node, int *zerop)
+{
+	struct chunk *alloc_ch = NULL;
 	unsigned long p, len;
 	unsigned int bucket;
 
-	bmk_assert(align >= BMK_PCPU_PAGE_SIZE && (align & (align-1)) == 0);
-	bmk_assert((unsigned)order < FREELIST_LEVELS);
-
-	pgalloc_lock();
 	for (bucket = order; bucket < FREELIST_LEVELS; bucket++) {
-		if ((alloc_ch = satisfies_p(bucket, align)) != NULL)
+		if ((alloc_ch = satisfies_p(node, bucket, align)) != NULL)
 			break;
 	}
-	if (!alloc_ch) {
-		pgalloc_unlock();
-		bmk_printf("cannot handle page request order %d/0x%lx!\n",
-		    order, align);
-		return 0;
-	}
-	/* Unlink the chunk. */
-	LIST_REMOVE(alloc_ch, entries);
+	if (!alloc_ch)
+		return NULL;
 
+	/* Unlink the chunk. */
 	bmk_assert(alloc_ch->magic == CHUNKMAGIC);
-	alloc_ch->magic = 0;
+	freechunk_unlink(alloc_ch);
 
 	/*
 	 * TODO: figure out if we can cheaply carve the block without
@@ -411,7 +575,10 @@ bmk_pgalloc_align(int order, unsigned long align)
 	p = (unsigned long)alloc_ch;
 
 	/* carve up leftovers (if any) */
-	carverange(p+len, order2size(bucket) - len);
+	carverange(p+len, order2size(bucket) - len, alloc_ch->node,
+	    alloc_ch->zero);
+	if (zerop)
+		*zerop = alloc_ch->zero;
 
 	map_alloc(alloc_ch, 1UL<<order);
 	DPRINTF(("bmk_pgalloc: allocated 0x%lx bytes at %p\n",
@@ -430,22 +597,26 @@ bmk_pgalloc_align(int order, unsigned long align)
 #endif
 
 	SANITY_CHECK();
-	pgalloc_unlock();
-
 	bmk_assert(((unsigned long)alloc_ch & (align-1)) == 0);
 	return alloc_ch;
 }
 
-void
-bmk_pgfree(void *pointer, int order)
+/*
+ * Return a chunk to the freelists, coalescing it with its buddies.
+ * zero says the chunk is known to be all zero.  A coalesced chunk is
+ * zero only if all its parts were, and then the headers of all but
+ * the first part are cleared.  Called with the lock held.
+ */
+static void
+buddy_free(void *pointer, int order, int zero)
 {
-	struct chunk *freed_ch, *to_merge_ch;
+	struct chunk *freed_ch, *to_merge_ch, *upper;
 	unsigned long mask;
+	int node;
 
 	DPRINTF(("bmk_pgfree: freeing 0x%lx bytes at %p\n",
 	    order2size(order), pointer));
 
-	pgalloc_lock();
 #ifdef BMK_PGALLOC_DEBUG
 	{
 		unsigned npgs = 1<<order;
@@ -460,6 +631,7 @@ bmk_pgfree(void *pointer, int order)
 	/* free the allocation in the bitmap */
 	map_free(pointer, 1UL << order);
 	pgalloc_usedkb -= order2size(order)>>10;
+	node = bmk_pgalloc_addrnode(pointer);
 
 	/* create as large a free chunk as we can */
 	for (freed_ch = pointer; (unsigned)order < FREELIST_LEVELS; ) {
@@ -468,31 +640,816 @@ bmk_pgfree(void *pointer, int order)
 			to_merge_ch = addr2chunk(freed_ch, -mask);
 			if (!addr_is_managed(to_merge_ch)
 			    || allocated_in_map(to_merge_ch)
-			    || chunklevel(to_merge_ch) != order)
+			    || chunklevel(to_merge_ch) != order
+			    || to_merge_ch->node != node)
 				break;
 			freed_ch->magic = 0;
 
 			/* merge with predecessor, point freed chuck there */
+			upper = freed_ch;
 			freed_ch = to_merge_ch;
 		} else {
 			to_merge_ch = addr2chunk(freed_ch, mask);
 			if (!addr_is_managed(to_merge_ch)
 			    || allocated_in_map(to_merge_ch)
-			    || chunklevel(to_merge_ch) != order)
+			    || chunklevel(to_merge_ch) != order
+			    || to_merge_ch->node != node)
 				break;
 			freed_ch->magic = 0;
 
 			/* merge with successor, freed chuck already correct */
+			upper = to_merge_ch;
 		}
 
-		to_merge_ch->magic = 0;
-		LIST_REMOVE(to_merge_ch, entries);
+		freechunk_unlink(to_merge_ch);
+		zero = zero && to_merge_ch->zero;
+		if (zero)
+			bmk_memset(upper, 0, sizeof(*upper));
 
 		order++;
 	}
 
-	freechunk_link(freed_ch, order);
+	freechunk_link(freed_ch, order, node, zero);
 
 	SANITY_CHECK();
+}
+
+/*
+ * Per-CPU hot lists for chunks of order 0 to PCP_ORDERS-1, which is
+ * what stacks, mbuf clusters and small allocator spans use.  A list
+ * is refilled from and drained to the freelists half a list at a
+ * time, so the lock is taken once per batch.  Hot lists are only
+ * used from thread context, which is never preempted, so they need
+ * no locking.  Chunks on hot lists stay marked allocated.
+ *
+ * A CPU only keeps chunks of its own node.  Chunks freed on another
+ * node are pushed onto a lock-free per-node stack, which the owning
+ * node's CPUs pick up when they refill.  The stack is only ever
+ * emptied as a whole, so pushing with a CAS is safe against ABA.
+ */
+#define PCP_ORDERS	4
+#define PCP_LISTMAX	32
+#define pcp_max(_order_) (PCP_LISTMAX >> (_order_))
+
+struct pcpfree {
+	struct pcpfree *next;
+};
+
+struct pcplist {
+	unsigned int pl_count[PCP_ORDERS];
+	void *pl_chunks[PCP_ORDERS][PCP_LISTMAX];
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+static struct pcplist pcplists[BMK_CORE_MAXCPUS];
+static _Atomic(struct pcpfree *) remotefree[BMK_PGALLOC_MAXNODES][PCP_ORDERS];
+
+static inline struct pcplist *
+pcplist_get(void)
+{
+	return &pcplists[bmk_get_cpu_info()->cpu];
+}
+
+/* Called with the lock held. */
+static void
+remote_drain(int node, int order)
+{
+	struct pcpfree *rf, *next;
+
+	rf = atomic_exchange(&remotefree[node][order], NULL);
+	for (; rf != NULL; rf = next) {
+		next = rf->next;
+		buddy_free(rf, order, 0);
+	}
+}
+
+static unsigned int
+pcp_refill(struct pcplist *pl, int order, int node)
+{
+	struct pcpfree *rf, *next;
+	unsigned int n = pcp_max(order) / 2;
+	void *p;
+
+	rf = atomic_exchange(&remotefree[node][order], NULL);
+	pgalloc_lock();
+	for (; rf != NULL; rf = next) {
+		next = rf->next;
+		if (pl->pl_count[order] < pcp_max(order))
+			pl->pl_chunks[order][pl->pl_count[order]++] = rf;
+		else
+			buddy_free(rf, order, 0);
+	}
+	while (pl->pl_count[order] < n
+	    && (p = buddy_alloc(order, order2size(order), node, NULL)) != NULL)
+		pl->pl_chunks[order][pl->pl_count[order]++] = p;
+	pgalloc_unlock();
+
+	return pl->pl_count[order];
+}
+
+static void
+pcp_drain(struct pcplist *pl, int order, unsigned int keep)
+{
+
+	pgalloc_lock();
+	while (pl->pl_count[order] > keep)
+		buddy_free(pl->pl_chunks[order][--pl->pl_count[order]], order,
+		    0);
+	pgalloc_unlock();
+}
+
+static void *
+pcp_alloc(int order, int node)
+{
+	struct pcplist *pl = pcplist_get();
+
+	if (pl->pl_count[order] == 0 && pcp_refill(pl, order, node) == 0)
+		return NULL;
+	return pl->pl_chunks[order][--pl->pl_count[order]];
+}
+
+static void
+pcp_free(void *pointer, int order)
+{
+	struct pcplist *pl;
+	struct pcpfree *rf, *head;
+	int node;
+
+	if ((node = bmk_pgalloc_addrnode(pointer)) != curnode()) {
+		rf = pointer;
+		head = atomic_load(&remotefree[node][order]);
+		do {
+			rf->next = head;
+		} while (!atomic_compare_exchange_weak(
+		    &remotefree[node][order], &head, rf));
+		return;
+	}
+
+	pl = pcplist_get();
+	if (pl->pl_count[order] == pcp_max(order))
+		pcp_drain(pl, order, pcp_max(order) / 2);
+	pl->pl_chunks[order][pl->pl_count[order]++] = pointer;
+}
+
+/*
+ * Give everything this CPU caches and all remote frees back to the
+ * freelists.  Chunks on other CPUs' hot lists stay where they are.
+ */
+static void
+pcp_reclaim(void)
+{
+	struct pcplist *pl = pcplist_get();
+	int n, order;
+
+	for (order = 0; order < PCP_ORDERS; order++)
+		pcp_drain(pl, order, 0);
+
+	pgalloc_lock();
+	for (n = 0; n < nnodes; n++) {
+		for (order = 0; order < PCP_ORDERS; order++)
+			remote_drain(n, order);
+	}
+	pgalloc_unlock();
+}
+
+/*
+ * Allocate preferably from node, or from the current CPU's node
+ * if node is negative.  Other nodes are used only if the preferred
+ * one cannot satisfy the request.  If zerop is not NULL, it is set
+ * as by buddy_alloc().
+ */
+static void *
+pgalloc_get(int order, unsigned long align, int node, int *zerop)
+{
+	void *p = NULL;
+	int i, retry;
+
+	if (zerop)
+		*zerop = 0;
+
+	bmk_assert(align >= BMK_PCPU_PAGE_SIZE && (align & (align-1)) == 0);
+	bmk_assert((unsigned)order < FREELIST_LEVELS);
+
+	if (node < 0 || node >= nnodes)
+		node = curnode();
+
+	if (order < PCP_ORDERS && align <= order2size(order)
+	    && node == curnode()
+	    && (p = pcp_alloc(order, node)) != NULL)
+		return p;
+
+	for (retry = 0; retry < 2 && !p; retry++) {
+		if (retry)
+			pcp_reclaim();
+		pgalloc_lock();
+		for (i = 0; i < nnodes && !p; i++)
+			p = buddy_alloc(order, align, (node + i) % nnodes,
+			    zerop);
+		pgalloc_unlock();
+	}
+	if (!p) {
+		bmk_printf("cannot handle page request order %d/0x%lx!\n",
+		    order, align);
+	}
+	return p;
+}
+
+/* Zero a chunk from pgalloc_get(), which may mostly be zero already. */
+static void
+pgzero(void *p, unsigned long nbytes, int zero)
+{
+
+	bmk_memset(p, 0, zero ? sizeof(struct chunk) : nbytes);
+}
+
+void *
+bmk_pgalloc_align_node(int order, unsigned long align, int node)
+{
+
+	return pgalloc_get(order, align, node, NULL);
+}
+
+/*
+ * Allocate zeroed pages.  Chunks which have not been touched since
+ * they were last known to be zero are not cleared again.
+ */
+void *
+bmk_pgalloc_zero(int order)
+{
+	void *p;
+	int zero;
+
+	if ((p = pgalloc_get(order, BMK_PCPU_PAGE_SIZE, -1, &zero)) != NULL)
+		pgzero(p, order2size(order), zero);
+	return p;
+}
+
+void
+bmk_pgfree(void *pointer, int order)
+{
+
+	if (order < PCP_ORDERS) {
+		pcp_free(pointer, order);
+		return;
+	}
+
+	pgalloc_lock();
+	buddy_free(pointer, order, 0);
+	pgalloc_unlock();
+}
+
+/*
+ * Free npages pages starting at pointer, as the largest naturally
+ * aligned chunks which fit.  The pieces bypass the hot lists so that
+ * they can coalesce with their neighbours right away.  Called with
+ * the lock held.
+ */
+static void
+npages_free(void *pointer, unsigned long npages, int zero)
+{
+	unsigned long addr = (unsigned long)pointer;
+	unsigned i, r;
+
+	while (npages) {
+		i = __builtin_ctzl(addr) - BMK_PCPU_PAGE_SHIFT;
+		r = 8*sizeof(npages) - (__builtin_clzl(npages)+1);
+		if (i > r)
+			i = r;
+		buddy_free((void *)addr, i, zero);
+		addr += order2size(i);
+		npages -= 1UL<<i;
+	}
+}
+
+/*
+ * Allocate npages contiguous pages, which need not be a power of two.
+ * The pages past npages in the covering chunk are given back right
+ * away, so at most one page worth of address space is rounded up.
+ */
+static void *
+npages_alloc(unsigned long npages, unsigned long align, int node,
+	int wantzero)
+{
+	unsigned long npg;
+	void *p;
+	int order, zero;
+
+	bmk_assert(npages > 0);
+	order = 8*sizeof(npages) - __builtin_clzl(npages);
+	if ((npages & (npages-1)) == 0)
+		order--;
+	if ((p = pgalloc_get(order, align, node, &zero)) == NULL)
+		return NULL;
+
+	npg = 1UL<<order;
+	if (npages < npg) {
+		pgalloc_lock();
+		npages_free((char *)p + npages*BMK_PCPU_PAGE_SIZE,
+		    npg - npages, zero);
+		pgalloc_unlock();
+	}
+	if (wantzero)
+		pgzero(p, npages*BMK_PCPU_PAGE_SIZE, zero);
+	return p;
+}
+
+void *
+bmk_pgalloc_npages(unsigned long npages, unsigned long align)
+{
+
+	return npages_alloc(npages, align, -1, 0);
+}
+
+void *
+bmk_pgalloc_npages_zero(unsigned long npages, unsigned long align)
+{
+
+	return npages_alloc(npages, align, -1, 1);
+}
+
+void *
+bmk_pgalloc_npages_node(unsigned long npages, unsigned long align, int node)
+{
+
+	return npages_alloc(npages, align, node, 0);
+}
+
+void
+bmk_pgfree_npages(void *pointer, unsigned long npages)
+{
+
+	pgalloc_lock();
+	npages_free(pointer, npages, 0);
+	pgalloc_unlock();
+}
+
+/*
+ * Try to extend the allocation of npages at pointer to newnpages
+ * without moving it, which works if the pages right after it are
+ * free and on the same node.  Returns nonzero on success.
+ *
+ * Since the page before the first free one is allocated, that free
+ * page must start a chunk, and so must every free page right after
+ * a free chunk.  The chunk headers found this way are thus genuine.
+ */
+int
+bmk_pgalloc_tryextend(void *pointer, unsigned long npages,
+	unsigned long newnpages)
+{
+	struct chunk *ch = NULL;
+	unsigned long addr, end, chend;
+	int node;
+
+	bmk_assert(newnpages > npages);
+	addr = (unsigned long)pointer + npages*BMK_PCPU_PAGE_SIZE;
+	end = (unsigned long)pointer + newnpages*BMK_PCPU_PAGE_SIZE;
+
+	pgalloc_lock();
+	node = bmk_pgalloc_addrnode(pointer);
+	for (chend = addr; chend < end; chend += order2size(ch->level)) {
+		ch = (struct chunk *)chend;
+		if (!addr_is_managed(ch) || allocated_in_map(ch)
+		    || ch->node != node) {
+			pgalloc_unlock();
+			return 0;
+		}
+		bmk_assert(ch->magic == CHUNKMAGIC);
+	}
+
+	/* all there, take the chunks and give back what sticks out */
+	while (addr < end) {
+		ch = (struct chunk *)addr;
+		freechunk_unlink(ch);
+		addr += order2size(ch->level);
+	}
+	if (chend > end)
+		carverange(end, chend - end, node, ch->zero);
+
+	addr = (unsigned long)pointer + npages*BMK_PCPU_PAGE_SIZE;
+	map_alloc((void *)addr, newnpages - npages);
+	pgalloc_usedkb += (end - addr)>>10;
+
+	SANITY_CHECK();
+	pgalloc_unlock();
+	return 1;
+}
+
+/*
+ * Allocate nbytes, rounded up to whole huge pages, aligned so that
+ * the range is covered by the fewest large page mappings.  Ranges of
+ * a giant page or more are giant page aligned when memory allows.
+ */
+void *
+bmk_pgalloc_huge(unsigned long nbytes, int node)
+{
+	unsigned long npages;
+	void *p = NULL;
+
+	nbytes = (nbytes + BMK_PGALLOC_HUGE_SIZE-1)
+	    & ~(BMK_PGALLOC_HUGE_SIZE-1);
+	if (nbytes == 0)
+		nbytes = BMK_PGALLOC_HUGE_SIZE;
+	npages = nbytes >> BMK_PCPU_PAGE_SHIFT;
+
+	if (nbytes >= BMK_PGALLOC_GIANT_SIZE)
+		p = npages_alloc(npages, BMK_PGALLOC_GIANT_SIZE, node, 0);
+	if (p == NULL)
+		p = npages_alloc(npages, BMK_PGALLOC_HUGE_SIZE, node, 0);
+	return p;
+}
+
+void
+bmk_pgfree_huge(void *pointer, unsigned long nbytes)
+{
+
+	nbytes = (nbytes + BMK_PGALLOC_HUGE_SIZE-1)
+	    & ~(BMK_PGALLOC_HUGE_SIZE-1);
+	if (nbytes == 0)
+		nbytes = BMK_PGALLOC_HUGE_SIZE;
+	bmk_pgfree_npages(pointer, nbytes >> BMK_PCPU_PAGE_SHIFT);
+}
+
+/*
+ * Carve long-lived objects out of huge pages, so that related data
+ * shares large TLB entries instead of being spread over memory.
+ * Arena memory is never given back.  The caller serializes access.
+ * If no huge page is available, the request is served from plain
+ * pages instead.
+ */
+void *
+bmk_pgarena_alloc(struct bmk_pgarena *pa, unsigned long nbytes,
+	unsigned long align)
+{
+	unsigned long addr, pad;
+	void *p;
+
+	bmk_assert(align > 0 && (align & (align-1)) == 0
+	    && align <= BMK_PGALLOC_HUGE_SIZE);
+
+	addr = (unsigned long)pa->pa_cur;
+	pad = -addr & (align-1);
+	if (pa->pa_cur == NULL || pad + nbytes > pa->pa_left) {
+		if (nbytes > BMK_PGALLOC_HUGE_SIZE / 2)
+			return bmk_pgalloc_huge(nbytes, pa->pa_node);
+		if ((p = bmk_pgalloc_huge(BMK_PGALLOC_HUGE_SIZE,
+		    pa->pa_node)) == NULL) {
+			return npages_alloc(bmk_round_page(nbytes)
+			    >> BMK_PCPU_PAGE_SHIFT, BMK_PCPU_PAGE_SIZE,
+			    pa->pa_node, 0);
+		}
+		pa->pa_cur = p;
+		pa->pa_left = BMK_PGALLOC_HUGE_SIZE;
+		addr = (unsigned long)p;
+		pad = 0;
+	}
+
+	pa->pa_cur = (char *)addr + pad + nbytes;
+	pa->pa_left -= pad + nbytes;
+	return (char *)addr + pad;
+}
+
+/*
+ * Balloon support.  Free memory handed back to the host stays marked
+ * allocated, and is remembered in a small table of ranges so that it
+ * can be asked for again later.  Largest chunks go first, which keeps
+ * both the table and the damage to large free chunks small.  Memory
+ * which comes back from the host is known to be zero.  Balloon
+ * operations are serialized by balloon_slock, so only they change
+ * the table.
+ */
+#define BALLOON_MAXRANGES 64
+static struct {
+	unsigned long start, npages;
+} balloon[BALLOON_MAXRANGES];
+static unsigned int nballoon;
+static unsigned long pgalloc_balloonkb;
+static bmk_simple_lock_t balloon_slock = BMK_SIMPLE_LOCK_INITIALIZER;
+
+/* Called with the lock held.  Returns nonzero if the table is full. */
+static int
+balloon_record(unsigned long start, unsigned long npages)
+{
+	unsigned long len = npages*BMK_PCPU_PAGE_SIZE;
+	unsigned int i;
+
+	for (i = 0; i < nballoon; i++) {
+		if (balloon[i].start + balloon[i].npages*BMK_PCPU_PAGE_SIZE
+		    == start) {
+			balloon[i].npages += npages;
+			return 0;
+		}
+		if (start + len == balloon[i].start) {
+			balloon[i].start = start;
+			balloon[i].npages += npages;
+			return 0;
+		}
+	}
+	if (nballoon == BALLOON_MAXRANGES)
+		return 1;
+	balloon[nballoon].start = start;
+	balloon[nballoon].npages = npages;
+	nballoon++;
+	return 0;
+}
+
+/*
+ * Hand up to npages of free memory to give(), which returns it to
+ * the host and returns 0 on success.  Returns the number of pages
+ * given.
+ */
+unsigned long
+bmk_pgalloc_balloon_inflate(unsigned long npages,
+	int (*give)(void *, unsigned long))
+{
+	struct chunk *ch;
+	unsigned long done = 0, n;
+	int order, node, zero;
+
+	bmk_simple_lock_enter(&balloon_slock);
+	while (done < npages) {
+		pgalloc_lock();
+		ch = NULL;
+		if (nballoon < BALLOON_MAXRANGES) {
+			for (order = FREELIST_LEVELS; order-- > 0 && !ch; ) {
+				if ((1UL<<order) > npages - done)
+					continue;
+				for (node = 0; node < nnodes && !ch; node++)
+					ch = LIST_FIRST(&freelist[node][order]);
+			}
+		}
+		if (ch == NULL) {
+			pgalloc_unlock();
+			break;
+		}
+		order = ch->level;
+		zero = ch->zero;
+		n = 1UL<<order;
+		freechunk_unlink(ch);
+		map_alloc(ch, n);
+		pgalloc_totalkb -= order2size(order)>>10;
+		pgalloc_unlock();
+
+		if (give(ch, n) != 0) {
+			pgalloc_lock();
+			pgalloc_totalkb += order2size(order)>>10;
+			pgalloc_usedkb += order2size(order)>>10;
+			buddy_free(ch, order, zero);
+			pgalloc_unlock();
+			break;
+		}
+
+		pgalloc_lock();
+		/* cannot fail, there was a free slot */
+		balloon_record((unsigned long)ch, n);
+		pgalloc_balloonkb += order2size(order)>>10;
+		pgalloc_unlock();
+		done += n;
+	}
+	bmk_simple_lock_exit(&balloon_slock);
+
+	return done;
+}
+
+/*
+ * Ask take() to get back up to npages of what was given to the host,
+ * returning 0 on success.  Returns the number of pages taken back.
+ */
+unsigned long
+bmk_pgalloc_balloon_deflate(unsigned long npages,
+	int (*take)(void *, unsigned long))
+{
+	unsigned long done = 0, n, addr;
+
+	bmk_simple_lock_enter(&balloon_slock);
+	while (done < npages) {
+		pgalloc_lock();
+		if (nballoon == 0) {
+			pgalloc_unlock();
+			break;
+		}
+		n = balloon[nballoon-1].npages;
+		if (n > npages - done)
+			n = npages - done;
+		balloon[nballoon-1].npages -= n;
+		addr = balloon[nballoon-1].start
+		    + balloon[nballoon-1].npages*BMK_PCPU_PAGE_SIZE;
+		if (balloon[nballoon-1].npages == 0)
+			nballoon--;
+		pgalloc_unlock();
+
+		if (take((void *)addr, n) != 0) {
+			pgalloc_lock();
+			balloon_record(addr, n);
+			pgalloc_unlock();
+			break;
+		}
+
+		pgalloc_lock();
+		pgalloc_balloonkb -= (n*BMK_PCPU_PAGE_SIZE)>>10;
+		pgalloc_totalkb += (n*BMK_PCPU_PAGE_SIZE)>>10;
+		pgalloc_usedkb += (n*BMK_PCPU_PAGE_SIZE)>>10;
+		npages_free((void *)addr, n, 1);
+		pgalloc_unlock();
+		done += n;
+	}
+	bmk_simple_lock_exit(&balloon_slock);
+
+	return done;
+}
+
+/*
+ * Balloon policy.  Once the platform has said how to move memory with
+ * bmk_pgalloc_balloon_attach() and the configuration has set a target
+ * with bmk_pgalloc_balloon_setfree(), idle CPUs keep about that much
+ * memory free.  A surplus of more than a quarter of the target goes to
+ * the host, and memory is asked back when less than half is left.
+ * Nothing happens until a CPU idles, so a burst of allocations may
+ * still run out of memory which the host holds.
+ */
+static int (*balloon_give)(void *, unsigned long);
+static int (*balloon_take)(void *, unsigned long);
+static unsigned long balloon_freekb;
+static atomic_int balloon_busy;
+
+void
+bmk_pgalloc_balloon_attach(int (*give)(void *, unsigned long),
+	int (*take)(void *, unsigned long))
+{
+
+	balloon_give = give;
+	balloon_take = take;
+}
+
+void
+bmk_pgalloc_balloon_setfree(unsigned long kb)
+{
+
+	balloon_freekb = kb;
+}
+
+/* returns nonzero if memory was moved */
+static int
+pgalloc_idleballoon(void)
+{
+	unsigned long target = balloon_freekb, freekb, n = 0;
+
+	if (target == 0 || balloon_give == NULL)
+		return 0;
+	if (atomic_exchange(&balloon_busy, 1))
+		return 0;
+
+	freekb = pgalloc_totalkb - pgalloc_usedkb;
+	if (freekb > target + target/4) {
+		n = ((freekb - target) << 10) / BMK_PCPU_PAGE_SIZE;
+		if (bmk_pgalloc_balloon_inflate(n, balloon_give) == 0) {
+			bmk_printf("balloon: host took no memory, stopping\n");
+			balloon_freekb = 0;
+		}
+	} else if (freekb < target/2 && pgalloc_balloonkb) {
+		n = ((target - freekb) << 10) / BMK_PCPU_PAGE_SIZE;
+		n = bmk_pgalloc_balloon_deflate(n, balloon_take);
+	}
+
+	atomic_store(&balloon_busy, 0);
+	return n != 0;
+}
+
+/*
+ * Idle time zeroing.  Boot memory and freed pages are not known to be
+ * zero, so idle CPUs clear free chunks for bmk_pgalloc_zero(), one at
+ * a time and PGZERO_STEP bytes per call.  The lock is held while
+ * clearing, which bounds how long allocations wait for it.
+ */
+#define PGZERO_STEP (64*1024)
+static atomic_int pgzero_busy;
+
+static struct chunk *
+pgzero_find(void)
+{
+	struct chunk *ch;
+	unsigned int i;
+	int n;
+
+	for (n = 0; n < nnodes; n++) {
+		for (i = FREELIST_LEVELS; i-- > 0; ) {
+			LIST_FOREACH(ch, &freelist[n][i], entries) {
+				if (!ch->zero)
+					return ch;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+pgalloc_idlezero(void)
+{
+	struct chunk *ch;
+	unsigned long len, n;
+
+	if (!atomic_load_explicit(&pgzero_dirty, memory_order_relaxed))
+		return;
+	if (atomic_exchange(&pgzero_busy, 1))
+		return;
+
+	pgalloc_lock();
+	if ((ch = pgzero_cur) == NULL)
+		ch = pgzero_cur = pgzero_find();
+	if (ch == NULL) {
+		atomic_store(&pgzero_dirty, 0);
+	} else {
+		len = order2size(ch->level);
+		n = len - ch->zeroed;
+		if (n > PGZERO_STEP)
+			n = PGZERO_STEP;
+		bmk_memset((char *)ch + ch->zeroed, 0, n);
+		ch->zeroed += n;
+		if (ch->zeroed == len) {
+			ch->zero = 1;
+			pgzero_cur = NULL;
+		}
+	}
+	pgalloc_unlock();
+
+	atomic_store(&pgzero_busy, 0);
+}
+
+/* Called by idle CPUs. */
+void
+bmk_pgalloc_idle(void)
+{
+
+	if (!pgalloc_idleballoon())
+		pgalloc_idlezero();
+}
+
+/*
+ * Print free memory per node and order, and how fragmented it is.
+ * The fragmentation figure is the share of free memory outside the
+ * largest free chunk; "small" is the share in chunks too small to
+ * back a huge page.
+ */
+void
+bmk_pgalloc_dumpstats(void)
+{
+	struct chunk *ch;
+	struct pcpfree *rf;
+	unsigned long freekb, smallkb, largest, levelhas, chunks;
+	unsigned long cachedkb = 0, remotekb = 0, cpu;
+	unsigned i;
+	int n;
+
+	for (cpu = 0; cpu < bmk_numcpus && cpu < BMK_CORE_MAXCPUS; cpu++) {
+		for (i = 0; i < PCP_ORDERS; i++)
+			cachedkb += pcplists[cpu].pl_count[i]
+			    * (order2size(i)>>10);
+	}
+
+	pgalloc_lock();
+	for (n = 0; n < nnodes; n++) {
+		for (i = 0; i < PCP_ORDERS; i++) {
+			rf = atomic_load(&remotefree[n][i]);
+			for (; rf != NULL; rf = rf->next)
+				remotekb += order2size(i)>>10;
+		}
+	}
+	bmk_printf("pgalloc total %ld kB, used %ld kB (remaining %ld kB), "
+	    "per-CPU %lu kB, remote frees %lu kB, ballooned %lu kB\n",
+	    pgalloc_totalkb, pgalloc_usedkb, pgalloc_totalkb - pgalloc_usedkb,
+	    cachedkb, remotekb, pgalloc_balloonkb);
+
+	for (n = 0; n < nnodes; n++) {
+		freekb = smallkb = largest = 0;
+		for (i = 0; i < FREELIST_LEVELS; i++) {
+			chunks = 0;
+			LIST_FOREACH(ch, &freelist[n][i], entries) {
+				chunks++;
+			}
+			if (chunks == 0)
+				continue;
+			levelhas = chunks * (order2size(i)>>10);
+			freekb += levelhas;
+			if (order2size(i) < BMK_PGALLOC_HUGE_SIZE)
+				smallkb += levelhas;
+			largest = order2size(i)>>10;
+		}
+		bmk_printf("node %d: %lu kB free, largest chunk %lu kB, "
+		    "fragmentation %lu%%, small %lu%%\n", n, freekb, largest,
+		    freekb ? 100 - (100*largest)/freekb : 0,
+		    freekb ? (100*smallkb)/freekb : 0);
+
+		for (i = 0; i < FREELIST_LEVELS; i++) {
+			if (LIST_EMPTY(&freelist[n][i]))
+				continue;
+
+			chunks = 0;
+			LIST_FOREACH(ch, &freelist[n][i], entries) {
+				chunks++;
+			}
+			levelhas = chunks * (order2size(i)>>10);
+			bmk_printf("%8ld kB: %8ld chunks, %12ld kB\t(%2ld%%)\n",
+			    order2size(i)>>10, chunks, levelhas,
+			    (100*levelhas)/freekb);
+		}
+	}
 	pgalloc_unlock();
 }
@@ -0,0 +1,166 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Grace periods are numbered.  Every CPU records in rc_seen the
+ * latest grace period it has seen when passing through a quiescent
+ * state.  Grace period rcu_gpnum is complete once every CPU has seen
+ * it, at which point rcu_completed catches up.  Nobody drives grace
+ * periods on their own: CPUs with callbacks waiting start and
+ * complete them from the scheduler, so an idle system does no work.
+ *
+ * A callback queued while rcu_gpnum is g waits for g+1, which starts
+ * only after the object was unlinked.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/null.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/rcu.h>
+#include <bmk-core/sched.h>
+
+/* wraparound-safe a < b */
+#define GP_LT(a, b) ((long)((a) - (b)) < 0)
+
+struct rcu_cpu {
+	unsigned long rc_seen;
+	struct bmk_rcu_head *rc_head;
+	struct bmk_rcu_head **rc_tail;
+	unsigned long rc_lastgp;	/* grace period of the tail */
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+static struct rcu_cpu rcu_cpu[BMK_CORE_MAXCPUS];
+
+static unsigned long rcu_gpnum;
+static unsigned long rcu_completed;
+
+static inline struct rcu_cpu *
+rcu_cpu_get(void)
+{
+
+	return &rcu_cpu[bmk_get_cpu_info()->cpu];
+}
+
+/*
+ * Complete the running grace period if every CPU has seen it, and
+ * start the next one if want is still ahead.
+ */
+static void
+rcu_advance(unsigned long want)
+{
+	unsigned long gp, done, i;
+
+	gp = __atomic_load_n(&rcu_gpnum, __ATOMIC_ACQUIRE);
+	done = __atomic_load_n(&rcu_completed, __ATOMIC_ACQUIRE);
+	if (done != gp) {
+		for (i = 0; i < bmk_numcpus; i++) {
+			if (GP_LT(__atomic_load_n(&rcu_cpu[i].rc_seen,
+			    __ATOMIC_ACQUIRE), gp))
+				return;
+		}
+		__atomic_compare_exchange_n(&rcu_completed, &done, gp, 0,
+		    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+		done = gp;
+	}
+	if (GP_LT(done, want))
+		__atomic_compare_exchange_n(&rcu_gpnum, &gp, gp + 1, 0,
+		    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void
+bmk_rcu_quiescent(void)
+{
+	struct rcu_cpu *rc = rcu_cpu_get();
+	unsigned long gp;
+
+	gp = __atomic_load_n(&rcu_gpnum, __ATOMIC_ACQUIRE);
+	if (rc->rc_seen != gp)
+		__atomic_store_n(&rc->rc_seen, gp, __ATOMIC_RELEASE);
+}
+
+/*
+ * Queue rh to have func called on it after a grace period.  Not to
+ * be used from interrupt handlers.
+ */
+void
+bmk_rcu_call(struct bmk_rcu_head *rh, void (*func)(struct bmk_rcu_head *))
+{
+	struct rcu_cpu *rc = rcu_cpu_get();
+
+	/* order the caller's unlink before sampling the grace period */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	rh->rh_gp = __atomic_load_n(&rcu_gpnum, __ATOMIC_RELAXED) + 1;
+	rh->rh_func = func;
+	rh->rh_next = NULL;
+	if (rc->rc_tail == NULL)
+		rc->rc_tail = &rc->rc_head;
+	*rc->rc_tail = rh;
+	rc->rc_tail = &rh->rh_next;
+	rc->rc_lastgp = rh->rh_gp;
+}
+
+/*
+ * Run this CPU's callbacks whose grace period has completed.
+ * Called from the scheduler with the CPU quiescent.
+ */
+void
+bmk_rcu_process(void)
+{
+	struct rcu_cpu *rc = rcu_cpu_get();
+	struct bmk_rcu_head *rh;
+	unsigned long done;
+
+	if (rc->rc_head == NULL)
+		return;
+
+	rcu_advance(rc->rc_lastgp);
+	done = __atomic_load_n(&rcu_completed, __ATOMIC_ACQUIRE);
+	while ((rh = rc->rc_head) != NULL && !GP_LT(done, rh->rh_gp)) {
+		if ((rc->rc_head = rh->rh_next) == NULL)
+			rc->rc_tail = &rc->rc_head;
+		rh->rh_func(rh);
+	}
+}
+
+/*
+ * Wait for a full grace period.  The caller must not be inside a
+ * read section.
+ */
+void
+bmk_rcu_synchronize(void)
+{
+	unsigned long want;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	want = __atomic_load_n(&rcu_gpnum, __ATOMIC_RELAXED) + 1;
+	for (;;) {
+		bmk_rcu_quiescent();
+		rcu_advance(want);
+		if (!GP_LT(__atomic_load_n(&rcu_completed, __ATOMIC_ACQUIRE),
+		    want))
+			break;
+		bmk_sched_yield();
+	}
+}
@@ -38,6 +38,7 @@
 #include <bmk-core/pgalloc.h>
 #include <bmk-core/printf.h>
 #include <bmk-core/queue.h>
+#include <bmk-core/rcu.h>
 #include <bmk-core/string.h>
 #include <bmk-core/sched.h>
 #include <bmk-core/simple_lock.h>
@@ -59,11 +60,11 @@ unsigned long bmk_mainstacksize;
 #define BLOCKTIME_MAX (1*1000*1000*1000)
 
 #define NAME_MAXLEN 26
-#define MAXCPUS 64
-
 /* flags and their meanings + invariants */
 #define THR_MUSTJOIN	0x01
 #define THR_EXTSTACK	0x02
+#define THR_FREETLS	0x04	/* reaper releases TLS (bmk_sched_exit) */
+#define THR_ALIVE	0x08	/* created and not yet reaped */
 
 #if !(defined(__i386__) || defined(__x86_64__))
 #define _TLS_I
@@ -108,6 +109,8 @@ struct bmk_thread {
 	char bt_name[NAME_MAXLEN];
 	unsigned char bt_timedout;
 	unsigned char bt_flags;
+	unsigned char bt_stackorder;
+	_Atomic(unsigned char) bt_oncpu;	/* hint for spinning waiters */
 
 	int bt_errno;
 
@@ -121,12 +124,54 @@ struct bmk_thread {
 	struct bmk_join_data bt_exit;
 
 	TAILQ_ENTRY(bmk_thread) bt_schedq;
+
+	/*
+	 * Accounting.  bt_stamp is the time the thread last became
+	 * runnable or was switched in, so that the time spent on a runq
+	 * (wakeup latency) and on the CPU can be told apart.  Times are
+	 * only kept while tracing, bt_stamp is 0 otherwise.
+	 */
+	bmk_time_t bt_stamp;
+	bmk_time_t bt_runtime;
+	bmk_time_t bt_waittime;
+	bmk_time_t bt_maxwait;
+	unsigned long bt_nswitches;
+	unsigned long bt_nmigrations;
+	unsigned int bt_lastcpu;
 	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
 };
 __thread struct bmk_thread *bmk_current;
 
-static struct lfqueue_node *nodes_array;
-static struct bmk_thread *thread_array;
+/*
+ * Threads and block queue nodes are allocated in chunks on demand,
+ * so that a large limit does not cost memory up front.  Chunk pointers
+ * never change once published, which keeps index to pointer lookups
+ * lock-free.
+ */
+#define THREAD_CHUNK_ORDER	8
+#define THREAD_CHUNK		(1UL << THREAD_CHUNK_ORDER)
+#define NODE_CHUNK_ORDER	10
+#define NODE_CHUNK		(1UL << NODE_CHUNK_ORDER)
+
+static struct bmk_thread *thread_chunks[BMK_MAX_THREADS / THREAD_CHUNK];
+static struct lfqueue_node *node_chunks[BMK_MAX_BLOCKQ / NODE_CHUNK];
+
+/* Boot-time limits (orders of the rings below), see sched_setlimits(). */
+static size_t threads_order, blockq_order;
+/* threads are grown up to this, see bmk_sched_setmaxthreads() */
+static size_t threads_limit;
+
+/* Number of slots currently backed by allocated chunks. */
+static size_t threads_grown, nodes_grown;
+static bmk_simple_lock_t grow_lock = BMK_SIMPLE_LOCK_INITIALIZER;
+/* thread and node chunks are packed into huge pages, under grow_lock */
+static struct bmk_pgarena grow_arena = BMK_PGARENA_INITIALIZER(-1);
+
+static inline struct bmk_thread *
+idx2thread(size_t idx)
+{
+	return &thread_chunks[idx >> THREAD_CHUNK_ORDER][idx & (THREAD_CHUNK-1)];
+}
 
 TAILQ_HEAD(threadqueue, bmk_thread);
 
@@ -145,12 +190,168 @@ TAILQ_HEAD(threadqueue, bmk_thread);
  *        running (via interrupt handler) have no effect.
  */
 
-static struct lfring * runq[MAXCPUS+1], * freeq, * zombieq;
+static struct lfring * runq[BMK_CORE_MAXCPUS+1], * freeq, * zombieq;
 static struct lfring * nodes;
-static struct threadqueue timeq[MAXCPUS+1];
+static struct threadqueue timeq[BMK_CORE_MAXCPUS+1];
+
+/*
+ * Per-CPU caches of thread stacks and initialized TLS areas, so that
+ * creating and reaping short-lived threads does not go through the
+ * global page and malloc locks.  Only touched from thread context
+ * without a scheduling point in between, and threads are never
+ * preempted, so no lock is needed.
+ */
+#define OBJCACHE_SIZE 16
+
+struct objcache {
+	unsigned long oc_count;
+	void *oc_objs[OBJCACHE_SIZE];
+};
+
+/*
+ * Stacks come in power-of-two size classes of 2^STACK_MINORDER up to
+ * 2^STACK_MAXORDER pages, each cached separately.  Where the platform
+ * supports it, every stack has an inaccessible guard page below it
+ * which stays in place while the stack sits in a cache.
+ */
+#define STACK_MINORDER	0
+#define STACK_MAXORDER	8
+#define STACK_CLASSES	(STACK_MAXORDER - STACK_MINORDER + 1)
+
+static unsigned long stack_guardpages;
+
+#define STACK_NPAGES(order) ((1UL << (order)) + stack_guardpages)
+
+struct sched_cache {
+	struct objcache sc_stacks[STACK_CLASSES];
+	struct objcache sc_tls;
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+static struct sched_cache sched_cache[BMK_CORE_MAXCPUS];
+
+static inline struct sched_cache *
+sched_cache_get(void)
+{
+	return &sched_cache[bmk_get_cpu_info()->cpu];
+}
+
+static inline void *
+objcache_get(struct objcache *oc)
+{
+	if (oc->oc_count == 0)
+		return NULL;
+	return oc->oc_objs[--oc->oc_count];
+}
+
+static inline int
+objcache_full(struct objcache *oc)
+{
+	return oc->oc_count == OBJCACHE_SIZE;
+}
+
+static inline void
+objcache_put(struct objcache *oc, void *obj)
+{
+	oc->oc_objs[oc->oc_count++] = obj;
+}
+
+/*
+ * Direct hand-off.  A thread woken by one that is about to block
+ * (bmk_sched_wake_and_switch() or a block callback) is parked in a
+ * per-CPU slot which schedule() checks before the runqs, so it is
+ * switched to without a round trip through the ring.  Wakers which
+ * keep running must not use it, the woken thread would jump the
+ * runq.  Only threads which could run on this CPU anyway are handed
+ * off, otherwise an idle CPU might have picked them up sooner.  To
+ * keep the runq from starving, at most HANDOFF_MAX hand-offs in a
+ * row are done before the next pick is made from the runq again.
+ */
+#define HANDOFF_MAX 8
+
+struct sched_handoff {
+	_Atomic(struct bmk_thread *) sh_thread;
+	_Atomic(unsigned int) sh_count;
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+static struct sched_handoff sched_handoff[BMK_CORE_MAXCPUS];
 
 static void (*scheduler_hook)(void *, void *);
 
+/*
+ * Scheduler event trace.  Each CPU logs into its own ring, which
+ * overwrites the oldest entries.  Interrupt handlers may wake threads
+ * while a thread on the same CPU is logging, hence the atomic slot
+ * reservation.  Entries are only for diagnostics, so a torn entry
+ * after a wraparound is tolerated.
+ */
+#define TRACE_ORDER	10
+#define TRACE_SIZE	(1UL << TRACE_ORDER)
+
+enum sched_event {
+	TRACE_SWITCH,	/* idx switched in, arg = previous thread */
+	TRACE_WAKE,	/* idx made runnable, arg = waker's CPU */
+	TRACE_BLOCK,	/* idx blocked, arg unused */
+	TRACE_YIELD,	/* idx yielded, arg unused */
+	TRACE_EXIT,	/* idx exited, arg unused */
+	TRACE_HANDOFF,	/* idx made runnable via hand-off slot */
+};
+
+static const char * const sched_event_names[] = {
+	[TRACE_SWITCH]	= "switch",
+	[TRACE_WAKE]	= "wake",
+	[TRACE_BLOCK]	= "block",
+	[TRACE_YIELD]	= "yield",
+	[TRACE_EXIT]	= "exit",
+	[TRACE_HANDOFF]	= "handoff",
+};
+
+struct sched_trace_ent {
+	bmk_time_t te_time;
+	unsigned int te_event;
+	unsigned int te_idx;
+	unsigned int te_arg;
+};
+
+struct sched_trace {
+	_Atomic(unsigned long) st_head;
+	struct sched_trace_ent st_ents[TRACE_SIZE];
+};
+
+static struct sched_trace *sched_trace[BMK_CORE_MAXCPUS];
+static int sched_trace_on;
+
+static void
+trace_log(enum sched_event event, unsigned int idx, unsigned int arg)
+{
+	struct sched_trace *st = sched_trace[bmk_get_cpu_info()->cpu];
+	struct sched_trace_ent *te;
+
+	if (st == NULL)
+		return;
+	te = &st->st_ents[atomic_fetch_add_explicit(&st->st_head, 1,
+	    memory_order_relaxed) & (TRACE_SIZE-1)];
+	te->te_time = bmk_platform_cpu_clock_monotonic();
+	te->te_event = event;
+	te->te_idx = idx;
+	te->te_arg = arg;
+}
+
+#define TRACE(event, idx, arg)						\
+  do {									\
+	if (__builtin_expect(sched_trace_on, 0))			\
+		trace_log(event, idx, arg);				\
+  } while (0)
+
+/* The clock is not free to read, so only on wakeups while tracing. */
+static inline bmk_time_t
+sched_stamp(void)
+{
+
+	if (__builtin_expect(sched_trace_on, 0))
+		return bmk_platform_cpu_clock_monotonic();
+	return 0;
+}
+
 static void
 join_callback(struct bmk_thread *prev, struct bmk_block_data *_block)
 {
@@ -190,17 +391,64 @@ join_post(struct bmk_join_data *join)
 	}
 }
 
-static bmk_simple_lock_t timeq_lock = BMK_SIMPLE_LOCK_INITIALIZER;
+/*
+ * Each timeq has its own lock, so inserting into or cancelling from
+ * one CPU's timeq does not contend with the other CPUs.  A thread
+ * stays on the timeq of bt_cpuidx, which never changes.
+ */
+static bmk_simple_lock_t timeq_lock[BMK_CORE_MAXCPUS+1];
+
+/*
+ * Put thread on its runq.  Everybody making a thread runnable goes
+ * through here so that the wakeup latency can be accounted.
+ */
+static inline void
+sched_runnable(struct bmk_thread *thread)
+{
+	thread->bt_stamp = sched_stamp();
+	TRACE(TRACE_WAKE, thread->bt_idx, bmk_get_cpu_info()->cpu);
+	lfring_enqueue(runq[thread->bt_cpuidx], threads_order,
+			thread->bt_idx, false);
+}
+
+/*
+ * Try to put thread in this CPU's hand-off slot.  Returns false if
+ * the thread must go through its runq instead.
+ */
+static bool
+sched_handoff_put(struct bmk_thread *thread, bool floating)
+{
+	unsigned long cpu = bmk_get_cpu_info()->cpu;
+	struct sched_handoff *sh = &sched_handoff[cpu];
+	struct bmk_thread *empty = NULL;
+
+	if (thread->bt_cpuidx != cpu &&
+	    !(floating && thread->bt_cpuidx == BMK_CORE_MAXCPUS))
+		return false;
+	if (atomic_load_explicit(&sh->sh_count, memory_order_relaxed)
+	    >= HANDOFF_MAX)
+		return false;
+
+	thread->bt_stamp = sched_stamp();
+	if (!atomic_compare_exchange_strong(&sh->sh_thread, &empty, thread))
+		return false;
+	TRACE(TRACE_HANDOFF, thread->bt_idx, cpu);
+	return true;
+}
 
-#if 0
 static void
 print_threadinfo(struct bmk_thread *thread)
 {
 
-	bmk_printf("thread \"%s\" at %p, flags 0x%x\n",
-	    thread->bt_name, thread, thread->bt_flags);
+	bmk_printf("%6u %-26s cpu %2u/%2u flags 0x%02x run %10ldus "
+	    "wait %10ldus maxwait %8ldus sw %8lu mig %6lu\n",
+	    thread->bt_idx, thread->bt_name,
+	    thread->bt_cpuidx, thread->bt_lastcpu, thread->bt_flags,
+	    (long)(thread->bt_runtime / 1000),
+	    (long)(thread->bt_waittime / 1000),
+	    (long)(thread->bt_maxwait / 1000),
+	    thread->bt_nswitches, thread->bt_nmigrations);
 }
-#endif
 
 /*
  * Insert thread into timeq at the correct place.
@@ -211,7 +459,7 @@ bmk_insert_timeq(struct bmk_thread *thread)
 	struct bmk_thread *iter;
 	unsigned int cpuidx = thread->bt_cpuidx;
 
-	bmk_simple_lock_enter(&timeq_lock);
+	bmk_simple_lock_enter(&timeq_lock[cpuidx]);
 
 	/*
 	 * Currently we require that a thread will block only
@@ -240,55 +488,175 @@ bmk_insert_timeq(struct bmk_thread *thread)
 	TAILQ_INSERT_TAIL(&timeq[cpuidx], thread, bt_schedq);
 
 done:
-	bmk_simple_lock_exit(&timeq_lock);
+	bmk_simple_lock_exit(&timeq_lock[cpuidx]);
 }
 
+/* Returns the smallest stack class fitting size, or -1. */
+static int
+stackorder(unsigned long size)
+{
+	int order;
+
+	for (order = STACK_MINORDER; order <= STACK_MAXORDER; order++) {
+		if ((BMK_PCPU_PAGE_SIZE << order) >= size)
+			return order;
+	}
+	return -1;
+}
+
+/*
+ * Stacks come from the NUMA node of the CPU the thread is bound to,
+ * or from the creating CPU's node for threads which are not bound.
+ * The per-CPU cache only holds stacks local to that CPU's node.
+ */
 static void
-stackalloc(void **stack, unsigned long *ss)
+stackalloc(void **stack, unsigned long *ss, unsigned int cpuidx, int order)
 {
-	*stack = bmk_pgalloc(bmk_stackpageorder);
-	*ss = bmk_stacksize;
+	struct objcache *oc;
+	char *p;
+	int node = -1;
+
+	oc = &sched_cache_get()->sc_stacks[order - STACK_MINORDER];
+	if (cpuidx != BMK_CORE_MAXCPUS && bmk_pgalloc_nnodes() > 1)
+		node = bmk_pgalloc_cpunode(cpuidx);
+	if (node == -1 || node ==
+	    bmk_pgalloc_cpunode(bmk_get_cpu_info()->cpu))
+		*stack = objcache_get(oc);
+	else
+		*stack = NULL;
+	if (*stack == NULL) {
+		p = bmk_pgalloc_npages_node(STACK_NPAGES(order),
+		    BMK_PCPU_PAGE_SIZE, node);
+		if (p != NULL && stack_guardpages) {
+			bmk_platform_guard(p, BMK_PCPU_PAGE_SIZE, 1);
+			p += BMK_PCPU_PAGE_SIZE;
+		}
+		*stack = p;
+	}
+	*ss = BMK_PCPU_PAGE_SIZE << order;
 }
 
 static void
-stackfree(struct bmk_thread *thread)
+stackfree(void *stack, int order)
 {
-	bmk_pgfree(thread->bt_stackbase, bmk_stackpageorder);
+	struct objcache *oc;
+	char *p = stack;
+
+	oc = &sched_cache_get()->sc_stacks[order - STACK_MINORDER];
+	if (!objcache_full(oc) && bmk_pgalloc_addrnode(stack)
+	    == bmk_pgalloc_cpunode(bmk_get_cpu_info()->cpu)) {
+		objcache_put(oc, stack);
+		return;
+	}
+	if (stack_guardpages) {
+		p -= BMK_PCPU_PAGE_SIZE;
+		bmk_platform_guard(p, BMK_PCPU_PAGE_SIZE, 0);
+	}
+	bmk_pgfree_npages(p, STACK_NPAGES(order));
 }
 
+/*
+ * Dump per-thread accounting.  Done without stopping anybody,
+ * so numbers of running threads may be slightly inconsistent.
+ * Run and wait times only advance while tracing.
+ */
 void
 bmk_sched_dumpqueue(void)
 {
-#if 0
-	struct bmk_thread *thr;
-
-	bmk_printf("BEGIN runq dump\n");
-	TAILQ_FOREACH(thr, &runq, bt_schedq) {
-		print_threadinfo(thr);
+	struct bmk_thread *thread;
+	size_t idx, grown;
+
+	grown = __atomic_load_n(&threads_grown, __ATOMIC_ACQUIRE);
+	bmk_printf("BEGIN thread dump (%lu slots)\n", (unsigned long)grown);
+	for (idx = 0; idx != grown; idx++) {
+		thread = idx2thread(idx);
+		if (thread->bt_flags & THR_ALIVE)
+			print_threadinfo(thread);
 	}
-	bmk_printf("END runq dump\n");
+	bmk_printf("END thread dump\n");
+}
 
-	bmk_printf("BEGIN timeq dump\n");
-	TAILQ_FOREACH(thr, &timeq, bt_schedq) {
-		print_threadinfo(thr);
+void
+bmk_sched_trace(int enable)
+{
+	struct sched_trace *st;
+	unsigned long i;
+
+	if (enable) {
+		for (i = 0; i < bmk_numcpus; i++) {
+			if (sched_trace[i] != NULL)
+				continue;
+			st = bmk_memcalloc(1, sizeof(*st),
+			    BMK_MEMWHO_WIREDBMK);
+			if (st == NULL) {
+				bmk_printf("sched: cannot allocate trace\n");
+				return;
+			}
+			sched_trace[i] = st;
+		}
 	}
-	bmk_printf("END timeq dump\n");
+	__atomic_store_n(&sched_trace_on, enable, __ATOMIC_RELEASE);
+}
 
-	bmk_printf("BEGIN blockq dump\n");
-	TAILQ_FOREACH(thr, &blockq, bt_schedq) {
-		print_threadinfo(thr);
+/*
+ * Print the trace rings oldest entry first, one CPU at a time, and
+ * the per-thread accounting.  Prints nothing if tracing is off.
+ */
+void
+bmk_sched_dumptrace(void)
+{
+	struct sched_trace *st;
+	struct sched_trace_ent *te;
+	unsigned long i, head, pos;
+
+	for (i = 0; i < bmk_numcpus; i++) {
+		if ((st = sched_trace[i]) == NULL)
+			continue;
+		head = atomic_load(&st->st_head);
+		pos = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+		bmk_printf("BEGIN cpu %lu trace\n", i);
+		for (; pos != head; pos++) {
+			te = &st->st_ents[pos & (TRACE_SIZE-1)];
+			bmk_printf("%16ld %-6s %6u %6u\n", (long)te->te_time,
+			    sched_event_names[te->te_event],
+			    te->te_idx, te->te_arg);
+		}
+		bmk_printf("END cpu %lu trace\n", i);
 	}
-	bmk_printf("END blockq dump\n");
-#endif
+	if (sched_trace_on)
+		bmk_sched_dumpqueue();
 }
 
 static void
 sched_switch(struct bmk_thread *prev, struct bmk_thread *next,
 	     struct bmk_block_data *data)
 {
+	unsigned int cpu = bmk_get_cpu_info()->cpu;
+	bmk_time_t now, wait;
+
+	/* stamps from before tracing was turned on are 0 */
+	if ((now = sched_stamp()) != 0) {
+		if (prev->bt_stamp != 0)
+			prev->bt_runtime += now - prev->bt_stamp;
+		if (next->bt_stamp != 0) {
+			wait = now - next->bt_stamp;
+			next->bt_waittime += wait;
+			if (wait > next->bt_maxwait)
+				next->bt_maxwait = wait;
+		}
+	}
+	prev->bt_stamp = next->bt_stamp = now;
+	if (next->bt_nswitches++ != 0 && next->bt_lastcpu != cpu)
+		next->bt_nmigrations++;
+	next->bt_lastcpu = cpu;
+	TRACE(TRACE_SWITCH, next->bt_idx, prev->bt_idx);
+
 	if (scheduler_hook)
 		scheduler_hook(prev->bt_cookie, next->bt_cookie);
 
+	atomic_store_explicit(&prev->bt_oncpu, 0, memory_order_relaxed);
+	atomic_store_explicit(&next->bt_oncpu, 1, memory_order_relaxed);
+
 	bmk_platform_cpu_sched_settls(&next->bt_tcb);
 
 	bmk_cpu_sched_switch(&prev->bt_tcb, data, &next->bt_tcb);
@@ -300,25 +668,37 @@ schedule(struct bmk_block_data *data)
 	struct bmk_thread *prev, *next, *thread;
 	struct bmk_thread *idle_thread;
 	struct bmk_cpu_info *info = bmk_get_cpu_info();
-	unsigned long cpuidx = info->cpu;
+	unsigned long cpuidx = info->cpu, spins = 0;
+	struct sched_handoff *sh = &sched_handoff[cpuidx];
 	size_t idx;
 
+	/* nobody is in a read section at a scheduling point */
+	bmk_rcu_quiescent();
+
 	prev = bmk_current;
 	for (;;) {
 		bmk_time_t curtime, waketime;
 
+		/* polled on every pass, the idle loop must not miss it */
+		if ((next = atomic_exchange(&sh->sh_thread, NULL)) != NULL) {
+			atomic_fetch_add_explicit(&sh->sh_count, 1,
+			    memory_order_relaxed);
+			break;
+		}
+		atomic_store_explicit(&sh->sh_count, 0, memory_order_relaxed);
+
 		if ((idx = lfring_dequeue(runq[cpuidx],
-				BMK_MAX_THREADS_ORDER, false))
+				threads_order, false))
 				!= LFRING_EMPTY) {
-			next = &thread_array[idx];
+			next = idx2thread(idx);
 			break;
 		}
 
 		if (bmk_numcpus != 1 &&
-			(idx = lfring_dequeue(runq[MAXCPUS],
-				BMK_MAX_THREADS_ORDER, false))
+			(idx = lfring_dequeue(runq[BMK_CORE_MAXCPUS],
+				threads_order, false))
 				!= LFRING_EMPTY) {
-			next = &thread_array[idx];
+			next = idx2thread(idx);
 			break;
 		}
 
@@ -333,7 +713,7 @@ schedule(struct bmk_block_data *data)
 		 * the timeouts are sorted, we process until we hit the
 		 * first one which will not be woked up.
 		 */
-		bmk_simple_lock_enter(&timeq_lock);
+		bmk_simple_lock_enter(&timeq_lock[cpuidx]);
 		while ((thread = TAILQ_FIRST(&timeq[cpuidx])) != NULL) {
 			if (thread->bt_wakeup_time <= curtime) {
 				/*
@@ -350,12 +730,14 @@ schedule(struct bmk_block_data *data)
 				break;
 			}
 		}
+		bmk_simple_lock_exit(&timeq_lock[cpuidx]);
 		if (bmk_numcpus != 1) {
-			while ((thread = TAILQ_FIRST(&timeq[MAXCPUS]))
+			bmk_simple_lock_enter(&timeq_lock[BMK_CORE_MAXCPUS]);
+			while ((thread = TAILQ_FIRST(&timeq[BMK_CORE_MAXCPUS]))
 					!= NULL) {
 				if (thread->bt_wakeup_time <= curtime) {
 					thread->bt_timedout = BMK_ETIMEDOUT;
-					TAILQ_REMOVE(&timeq[MAXCPUS],
+					TAILQ_REMOVE(&timeq[BMK_CORE_MAXCPUS],
 							thread, bt_schedq);
 					thread->bt_wake(thread);
 				} else {
@@ -365,8 +747,8 @@ schedule(struct bmk_block_data *data)
 					break;
 				}
 			}
+			bmk_simple_lock_exit(&timeq_lock[BMK_CORE_MAXCPUS]);
 		}
-		bmk_simple_lock_exit(&timeq_lock);
 
 		idle_thread = info->idle_thread;
 		if (prev != idle_thread) {
@@ -374,6 +756,15 @@ schedule(struct bmk_block_data *data)
 			break;
 		}
 
+		/*
+		 * Keep grace periods and TLB generations going while idle,
+		 * and clear or balloon free memory.
+		 */
+		bmk_rcu_quiescent();
+		bmk_rcu_process();
+		bmk_platform_vmem_idle();
+		bmk_pgalloc_idle();
+
 		/*
 		 * Nothing to run, block until waketime or until an interrupt
 		 * occurs, whichever happens first.  The call will enable
@@ -381,6 +772,9 @@ schedule(struct bmk_block_data *data)
 		 */
 		//FIXME: need a proper way to sleep across all CPUs
 		//bmk_platform_cpu_block(waketime);
+
+		/* until then, hand the vCPU back now and then */
+		bmk_spin_wait(&spins);
 	}
 
 	/*
@@ -396,32 +790,56 @@ schedule(struct bmk_block_data *data)
 	 * Reaper.  This always runs in the context of the first "non-virgin"
 	 * thread that was scheduled after the current thread decided to exit.
 	 */
-	while ((idx = lfring_dequeue(zombieq, BMK_MAX_THREADS_ORDER, false))
+	while ((idx = lfring_dequeue(zombieq, threads_order, false))
 			!= LFRING_EMPTY) {
-		struct bmk_thread *thread = &thread_array[idx];
+		struct bmk_thread *thread = idx2thread(idx);
 
 		if ((thread->bt_flags & THR_EXTSTACK) == 0)
-			stackfree(thread);
-		lfring_enqueue(freeq, BMK_MAX_THREADS_ORDER, idx, false);
+			stackfree(thread->bt_stackbase, thread->bt_stackorder);
+		if (thread->bt_flags & THR_FREETLS)
+			bmk_sched_tls_free((void *)thread->bt_tcb.btcb_tp);
+		thread->bt_flags &= ~THR_ALIVE;
+		lfring_enqueue(freeq, threads_order, idx, false);
 	}
+
+	bmk_rcu_process();
 }
 
 /*
- * Allocate tls and initialize it.
- * NOTE: does not initialize tcb, see inittcb().
+ * (Re)initialize the static TLS image.  This is all a thread can
+ * dirty: the TCB words past it are rewritten by inittcb() anyway.
+ * Stores to TLS variables are plain memory writes which leave no
+ * trace, so the whole tdata/tbss image is rewritten every time.
  */
-void *
-bmk_sched_tls_alloc(void)
+static void
+tls_init(char *p)
 {
-	char *tlsmem, *p;
-
-	tlsmem = p = bmk_memalloc(TLSAREASIZE, 0, BMK_MEMWHO_WIREDBMK);
 #ifdef _TLS_I
 	bmk_memset(p, 0, 2*sizeof(void *));
 	p += 2 * sizeof(void *);
 #endif
 	bmk_memcpy(p, _tdata_start, TDATASIZE);
 	bmk_memset(p + TDATASIZE, 0, TBSSSIZE);
+}
+
+/*
+ * Allocate tls and initialize it.
+ * NOTE: does not initialize tcb, see inittcb().
+ */
+void *
+bmk_sched_tls_alloc(void)
+{
+	char *tlsmem;
+	void *tls;
+
+	/* cached areas were already reinitialized when freed */
+	if ((tls = objcache_get(&sched_cache_get()->sc_tls)) != NULL)
+		return tls;
+
+	tlsmem = bmk_memalloc(TLSAREASIZE, 0, BMK_MEMWHO_WIREDBMK);
+	if (tlsmem == NULL)
+		return NULL;
+	tls_init(tlsmem);
 
 	return tlsmem + TCBOFFSET;
 }
@@ -430,11 +848,18 @@ bmk_sched_tls_alloc(void)
  * Free tls
  */
 void
-bmk_sched_tls_free(void *mem)
+bmk_sched_tls_free(void *tls)
 {
+	struct objcache *oc = &sched_cache_get()->sc_tls;
+	char *tlsmem = (char *)tls - TCBOFFSET;
 
-	mem = (void *)((unsigned long)mem - TCBOFFSET);
-	bmk_memfree(mem, BMK_MEMWHO_WIREDBMK);
+	if (objcache_full(oc)) {
+		bmk_memfree(tlsmem, BMK_MEMWHO_WIREDBMK);
+	} else {
+		/* pay for reinitialization here, not on creation */
+		tls_init(tlsmem);
+		objcache_put(oc, tls);
+	}
 }
 
 void *
@@ -466,15 +891,78 @@ initcurrent(void *tcb, struct bmk_thread *value)
 	*dst = value;
 }
 
+/*
+ * Back the next chunk of thread slots with memory.  The first new slot
+ * is returned to the caller, the rest go to freeq.  Returns LFRING_EMPTY
+ * when the boot-time limit is reached.
+ */
+static size_t
+thread_grow(void)
+{
+	struct bmk_thread *chunk;
+	size_t idx, i;
+
+	bmk_simple_lock_enter(&grow_lock);
+	/* Somebody may have grown or freed in the meantime. */
+	idx = lfring_dequeue(freeq, threads_order, false);
+	if (idx != LFRING_EMPTY || threads_grown >= threads_limit)
+		goto out;
+
+	chunk = bmk_pgarena_alloc(&grow_arena, sizeof(*chunk) * THREAD_CHUNK,
+	    BMK_PCPU_L1_SIZE);
+	if (!chunk)
+		goto out;
+	/* bmk_sched_dumpqueue() walks all slots, clear THR_ALIVE */
+	bmk_memset(chunk, 0, sizeof(*chunk) * THREAD_CHUNK);
+	thread_chunks[threads_grown >> THREAD_CHUNK_ORDER] = chunk;
+
+	idx = threads_grown;
+	threads_grown += THREAD_CHUNK;
+	for (i = idx + 1; i != threads_grown; i++)
+		lfring_enqueue(freeq, threads_order, i, false);
+out:
+	bmk_simple_lock_exit(&grow_lock);
+	return idx;
+}
+
+static size_t
+node_grow(void)
+{
+	struct lfqueue_node *chunk;
+	size_t idx, i;
+
+	bmk_simple_lock_enter(&grow_lock);
+	idx = lfring_dequeue(nodes, blockq_order, false);
+	if (idx != LFRING_EMPTY || nodes_grown == (1UL << blockq_order))
+		goto out;
+
+	chunk = bmk_pgarena_alloc(&grow_arena, sizeof(*chunk) * NODE_CHUNK,
+	    BMK_PCPU_L1_SIZE);
+	if (!chunk)
+		goto out;
+	for (i = 0; i != NODE_CHUNK; i++)
+		chunk[i].index = nodes_grown + i;
+	node_chunks[nodes_grown >> NODE_CHUNK_ORDER] = chunk;
+
+	idx = nodes_grown;
+	nodes_grown += NODE_CHUNK;
+	for (i = idx + 1; i != nodes_grown; i++)
+		lfring_enqueue(nodes, blockq_order, i, false);
+out:
+	bmk_simple_lock_exit(&grow_lock);
+	return idx;
+}
+
 static struct lfqueue_node *
 do_block_node_alloc(void)
 {
 	size_t idx;
 
-	if ((idx = lfring_dequeue(nodes, BMK_MAX_BLOCKQ_ORDER, false))
-			== LFRING_EMPTY)
+	if ((idx = lfring_dequeue(nodes, blockq_order, false))
+			== LFRING_EMPTY &&
+	    (idx = node_grow()) == LFRING_EMPTY)
 		bmk_platform_halt("ran out of block queue nodes");
-	return &nodes_array[idx];
+	return &node_chunks[idx >> NODE_CHUNK_ORDER][idx & (NODE_CHUNK-1)];
 }
 
 static struct bmk_thread *
@@ -482,26 +970,36 @@ do_sched_create_withtls(const char *name, void *cookie, int joinable,
 	int cpuidx, void (*f)(void *), void *data,
 	void *stack_base, unsigned long stack_size, void *tlsarea, bool insert)
 {
-	size_t idx = lfring_dequeue(freeq, BMK_MAX_THREADS_ORDER, false);
+	size_t idx = lfring_dequeue(freeq, threads_order, false);
 	struct bmk_thread *thread;
+	int order;
 
-	if (idx == LFRING_EMPTY)
+	if (idx == LFRING_EMPTY && (idx = thread_grow()) == LFRING_EMPTY)
 		return NULL;
 
-	thread = &thread_array[idx];
+	thread = idx2thread(idx);
 	bmk_memset(thread, 0, sizeof(*thread));
 	thread->bt_idx = (unsigned int) idx;
+	thread->bt_flags = THR_ALIVE;
 	thread->bt_cpuidx = (bmk_numcpus == 1) ? 0 :
-		((cpuidx == -1) ? MAXCPUS : (unsigned int) cpuidx);
-	if (thread->bt_cpuidx > MAXCPUS)
+		((cpuidx == -1) ? BMK_CORE_MAXCPUS : (unsigned int) cpuidx);
+	if (thread->bt_cpuidx > BMK_CORE_MAXCPUS)
 		bmk_platform_halt("out of range CPU index");
 	bmk_strncpy(thread->bt_name, name, sizeof(thread->bt_name)-1);
 
 	if (!stack_base) {
-		bmk_assert(stack_size == 0);
-		stackalloc(&stack_base, &stack_size);
+		order = stack_size ? stackorder(stack_size)
+		    : (int)bmk_stackpageorder;
+		if (order != -1)
+			stackalloc(&stack_base, &stack_size,
+			    thread->bt_cpuidx, order);
+		if (!stack_base) {
+			lfring_enqueue(freeq, threads_order, idx, false);
+			return NULL;
+		}
+		thread->bt_stackorder = order;
 	} else {
-		thread->bt_flags = THR_EXTSTACK;
+		thread->bt_flags |= THR_EXTSTACK;
 	}
 	thread->bt_stackbase = stack_base;
 	if (joinable) {
@@ -522,9 +1020,9 @@ do_sched_create_withtls(const char *name, void *cookie, int joinable,
 	thread->bt_block_node = do_block_node_alloc();
 	thread->bt_block_node->object = thread;
 
+	thread->bt_stamp = sched_stamp();
 	if (insert)
-		lfring_enqueue(runq[thread->bt_cpuidx], BMK_MAX_THREADS_ORDER,
-				idx, false);
+		sched_runnable(thread);
 
 	return thread;
 }
@@ -543,8 +1041,16 @@ do_sched_create(const char *name, void *cookie, int joinable,
 	int cpuidx, void (*f)(void *), void *data,
 	void *stack_base, unsigned long stack_size, bool insert)
 {
-	return do_sched_create_withtls(name, cookie, joinable, cpuidx, f,
-		data, stack_base, stack_size, bmk_sched_tls_alloc(), insert);
+	struct bmk_thread *thread;
+	void *tls;
+
+	if ((tls = bmk_sched_tls_alloc()) == NULL)
+		return NULL;
+	thread = do_sched_create_withtls(name, cookie, joinable, cpuidx, f,
+		data, stack_base, stack_size, tls, insert);
+	if (thread == NULL)
+		bmk_sched_tls_free(tls);
+	return thread;
 }
 
 struct bmk_thread *
@@ -560,7 +1066,7 @@ static void
 exit_callback(struct bmk_thread *prev, struct bmk_block_data *data)
 {
 	/* Put onto exited list */
-	lfring_enqueue(zombieq, BMK_MAX_THREADS_ORDER, prev->bt_idx, false);
+	lfring_enqueue(zombieq, threads_order, prev->bt_idx, false);
 }
 
 static struct bmk_block_data exit_data = { .callback = exit_callback };
@@ -576,6 +1082,7 @@ bmk_sched_exit_withtls(void)
 	}
 
 	/* bye */
+	TRACE(TRACE_EXIT, thread->bt_idx, 0);
 	schedule(&exit_data);
 	bmk_platform_halt("schedule() returned for a dead thread!\n");
 }
@@ -583,7 +1090,8 @@ bmk_sched_exit_withtls(void)
 void
 bmk_sched_exit(void)
 {
-	bmk_sched_tls_free((void *)bmk_current->bt_tcb.btcb_tp);
+	/* Still running on it, so let the reaper release the TLS. */
+	bmk_current->bt_flags |= THR_FREETLS;
 	bmk_sched_exit_withtls();
 }
 
@@ -632,6 +1140,7 @@ int
 bmk_sched_block(struct bmk_block_data *data)
 {
 	bmk_current->bt_timedout = 0;
+	TRACE(TRACE_BLOCK, bmk_current->bt_idx, 0);
 	schedule(data);
 	return bmk_current->bt_timedout;
 }
@@ -639,26 +1148,144 @@ bmk_sched_block(struct bmk_block_data *data)
 void
 bmk_sched_wake(struct bmk_thread *thread)
 {
-	lfring_enqueue(runq[thread->bt_cpuidx], BMK_MAX_THREADS_ORDER,
-			thread->bt_idx, false);
+	sched_runnable(thread);
 }
 
+/*
+ * Whether thread is running on some CPU right now.  Only a hint, the
+ * answer may be stale by the time the caller looks at it.
+ */
+int
+bmk_sched_oncpu(struct bmk_thread *thread)
+{
+	return atomic_load_explicit(&thread->bt_oncpu, memory_order_relaxed);
+}
+
+/*
+ * Wake a thread which the caller expects to be the next one to run
+ * on this CPU, i.e. the caller is about to block or is a block
+ * callback.  Falls back to an ordinary wakeup.
+ */
 void
-bmk_sched_wake_timeq(struct bmk_thread *thread)
+bmk_sched_wake_handoff(struct bmk_thread *thread)
+{
+	if (!sched_handoff_put(thread, false))
+		sched_runnable(thread);
+}
+
+/*
+ * Wake thread and block the current one, switching to the woken
+ * thread directly if fairness allows.  Since the switch is immediate,
+ * a thread not bound to any CPU can be handed off too.
+ */
+int
+bmk_sched_wake_and_switch(struct bmk_thread *thread,
+	struct bmk_block_data *data)
+{
+	if (!sched_handoff_put(thread, true))
+		sched_runnable(thread);
+	return bmk_sched_block(data);
+}
+
+/*
+ * Take a thread blocked with a timeout off the timeout queue without
+ * waking it.  Returns nonzero on success, after which the caller is
+ * responsible for the wakeup, or zero if the timeout already fired.
+ */
+int
+bmk_sched_cancel_timeq(struct bmk_thread *thread)
 {
+	unsigned int cpuidx = thread->bt_cpuidx;
 	int timedout;
 
-	bmk_simple_lock_enter(&timeq_lock);
+	bmk_simple_lock_enter(&timeq_lock[cpuidx]);
 	timedout = thread->bt_timedout;
 	if (!timedout) {
-		TAILQ_REMOVE(&timeq[thread->bt_cpuidx], thread, bt_schedq);
+		TAILQ_REMOVE(&timeq[cpuidx], thread, bt_schedq);
 	}
-	bmk_simple_lock_exit(&timeq_lock);
+	bmk_simple_lock_exit(&timeq_lock[cpuidx]);
+
+	return !timedout;
+}
 
-	if (!timedout)
+void
+bmk_sched_wake_timeq(struct bmk_thread *thread)
+{
+	if (bmk_sched_cancel_timeq(thread))
 		bmk_sched_wake(thread);
 }
 
+/*
+ * Pick the size of the thread rings.  Unless fixed at compile time,
+ * make room for more threads than the default limit on guests with
+ * the memory for it, so that bmk_sched_setmaxthreads() can raise the
+ * limit later: as many threads as there are default sized stacks in
+ * memory, as long as the rings take no more than 1/64 of it.  The run
+ * queues, free and zombie queues and the node ring are allocated at
+ * full size up front, one run queue per CPU.  Every thread owns one
+ * block queue node and every block queue one more, hence the extra
+ * room for the nodes.
+ */
+static unsigned long
+sched_ringsize(size_t order)
+{
+
+	return (bmk_numcpus + 3) * LFRING_SIZE(order)
+	    + LFRING_SIZE(order + BMK_BLOCKQ_EXTRA_ORDER);
+}
+
+static void
+sched_setlimits(void)
+{
+#ifdef BMK_SCHED_THREADS_ORDER
+	threads_order = BMK_SCHED_THREADS_ORDER;
+#else
+	unsigned long nstacks = bmk_memsize
+	    / (STACK_NPAGES(bmk_stackpageorder) * BMK_PCPU_PAGE_SIZE);
+
+	threads_order = BMK_MIN_THREADS_ORDER;
+	while (threads_order < BMK_MAX_THREADS_ORDER &&
+	    (2UL << threads_order) <= nstacks &&
+	    sched_ringsize(threads_order + 1) <= bmk_memsize / 64)
+		threads_order++;
+#endif
+	if (threads_order < THREAD_CHUNK_ORDER ||
+	    threads_order > BMK_MAX_THREADS_ORDER)
+		bmk_platform_halt("invalid thread limit");
+	blockq_order = threads_order + BMK_BLOCKQ_EXTRA_ORDER;
+	threads_limit = 1UL << threads_order;
+	if (threads_order > BMK_MIN_THREADS_ORDER)
+		threads_limit = 1UL << BMK_MIN_THREADS_ORDER;
+}
+
+unsigned long
+bmk_sched_maxthreads(void)
+{
+	return threads_limit;
+}
+
+/*
+ * Change the thread limit, within what the rings were sized for.
+ * A lower limit only stops further growth, slots which were already
+ * grown stay in use.  Returns the new limit.
+ */
+unsigned long
+bmk_sched_setmaxthreads(unsigned long n)
+{
+
+	if (n > (1UL << threads_order))
+		n = 1UL << threads_order;
+	n = (n + THREAD_CHUNK-1) & ~(THREAD_CHUNK-1);
+	if (n == 0)
+		n = THREAD_CHUNK;
+
+	bmk_simple_lock_enter(&grow_lock);
+	threads_limit = n;
+	bmk_simple_lock_exit(&grow_lock);
+
+	return n;
+}
+
 /*
  * Calculate offset of bmk_current early, so that we can use it
  * in thread creation.  Attempt to not depend on allocating the
@@ -676,62 +1303,67 @@ bmk_sched_init(void)
 	size_t i;
 	struct lfring *local_runq;
 	unsigned long ncpus = bmk_numcpus;
+	void *p;
 
-	if (ncpus > MAXCPUS)
+	if (ncpus > BMK_CORE_MAXCPUS)
 		bmk_platform_halt("too many CPUs");
 
-	for (i = 0; i <= MAXCPUS; i++) {
+	for (i = 0; i <= BMK_CORE_MAXCPUS; i++) {
 		struct threadqueue tq_init = TAILQ_HEAD_INITIALIZER(timeq[i]);
 		timeq[i] = tq_init;
+		bmk_simple_lock_init_flags(&timeq_lock[i],
+		    BMK_SIMPLE_LOCK_TICKET|BMK_SIMPLE_LOCK_PV);
 		runq[i] = NULL;
 	}
 
-	nodes_array = bmk_memalloc(sizeof(struct lfqueue_node) * BMK_MAX_BLOCKQ,
-				BMK_PCPU_L1_SIZE, BMK_MEMWHO_WIREDBMK);
-	if (!nodes_array)
-		bmk_platform_halt("cannot allocate nodes_array");
-	for (i = 0; i != BMK_MAX_BLOCKQ; i++)
-		nodes_array[i].index = i;
+	/* see if the platform can do guard pages */
+	if ((p = bmk_pgalloc_one()) != NULL) {
+		if (bmk_platform_guard(p, BMK_PCPU_PAGE_SIZE, 1) == 0) {
+			bmk_platform_guard(p, BMK_PCPU_PAGE_SIZE, 0);
+			stack_guardpages = 1;
+		}
+		bmk_pgfree_one(p);
+	}
+	if (bmk_stackpageorder > STACK_MAXORDER)
+		bmk_platform_halt("unsupported default stack size");
 
-	thread_array = bmk_memalloc(sizeof(struct bmk_thread) * BMK_MAX_THREADS,
-				BMK_PCPU_L1_SIZE, BMK_MEMWHO_WIREDBMK);
-	if (!thread_array)
-		bmk_platform_halt("cannot allocate thread_array");
+	sched_setlimits();
 
-	freeq = bmk_memalloc(LFRING_SIZE(BMK_MAX_THREADS_ORDER),
+	freeq = bmk_memalloc(LFRING_SIZE(threads_order),
 			LFRING_ALIGN, BMK_MEMWHO_WIREDBMK);
 	if (!freeq)
 		bmk_platform_halt("cannot allocate freeq");
-	lfring_init_full(freeq, BMK_MAX_THREADS_ORDER);
+	lfring_init_empty(freeq, threads_order);
 
 	for (i = 0; i < ncpus; i++) {
-		local_runq = bmk_memalloc(LFRING_SIZE(BMK_MAX_THREADS_ORDER),
+		local_runq = bmk_memalloc(LFRING_SIZE(threads_order),
 			LFRING_ALIGN, BMK_MEMWHO_WIREDBMK);
 		if (!local_runq)
 			bmk_platform_halt("cannot allocate local runq");
-		lfring_init_empty(local_runq, BMK_MAX_THREADS_ORDER);
+		lfring_init_empty(local_runq, threads_order);
 		runq[i] = local_runq;
 	}
 
 	if (ncpus != 1) {
-		runq[MAXCPUS] = bmk_memalloc(LFRING_SIZE(BMK_MAX_THREADS_ORDER),
+		runq[BMK_CORE_MAXCPUS] =
+			bmk_memalloc(LFRING_SIZE(threads_order),
 				LFRING_ALIGN, BMK_MEMWHO_WIREDBMK);
-		if (!runq[MAXCPUS])
+		if (!runq[BMK_CORE_MAXCPUS])
 			bmk_platform_halt("cannot allocate runq");
-		lfring_init_empty(runq[MAXCPUS], BMK_MAX_THREADS_ORDER);
+		lfring_init_empty(runq[BMK_CORE_MAXCPUS], threads_order);
 	}
 
-	zombieq = bmk_memalloc(LFRING_SIZE(BMK_MAX_THREADS_ORDER),
+	zombieq = bmk_memalloc(LFRING_SIZE(threads_order),
 			LFRING_ALIGN, BMK_MEMWHO_WIREDBMK);
 	if (!zombieq)
 		bmk_platform_halt("cannot allocate zombieq");
-	lfring_init_empty(zombieq, BMK_MAX_THREADS_ORDER);
+	lfring_init_empty(zombieq, threads_order);
 
-	nodes = bmk_memalloc(LFRING_SIZE(BMK_MAX_BLOCKQ_ORDER),
+	nodes = bmk_memalloc(LFRING_SIZE(blockq_order),
 			LFRING_ALIGN, BMK_MEMWHO_WIREDBMK);
 	if (!nodes)
 		bmk_platform_halt("cannot allocate nodes");
-	lfring_init_full(nodes, BMK_MAX_BLOCKQ_ORDER);
+	lfring_init_empty(nodes, blockq_order);
 
 	inittcb(&tcbinit, &tlsinit, 0);
 	bmk_platform_cpu_sched_settls(&tcbinit);
@@ -773,7 +1405,8 @@ bmk_sched_startmain(void (*mainfun)(void *), void *arg)
 	bmk_strcpy(initthread.bt_name, "init");
 
 	if (mainfun) {
-		stackalloc(&bmk_mainstackbase, &bmk_mainstacksize);
+		stackalloc(&bmk_mainstackbase, &bmk_mainstacksize,
+		    BMK_CORE_MAXCPUS, bmk_stackpageorder);
 		thread = do_sched_create("main", NULL, 0, -1, mainfun, arg,
 				bmk_mainstackbase, bmk_mainstacksize, false);
 		if (thread == NULL)
@@ -823,8 +1456,7 @@ static void
 yield_callback(struct bmk_thread *prev, struct bmk_block_data *data)
 {
 	/* make schedulable and re-insert into the run queue */
-	lfring_enqueue(runq[prev->bt_cpuidx], BMK_MAX_THREADS_ORDER,
-			prev->bt_idx, false);
+	sched_runnable(prev);
 }
 
 static struct bmk_block_data yield_data = { .callback = yield_callback };
@@ -832,17 +1464,23 @@ static struct bmk_block_data yield_data = { .callback = yield_callback };
 void
 bmk_sched_yield(void)
 {
+	TRACE(TRACE_YIELD, bmk_current->bt_idx, 0);
 	schedule(&yield_data);
 }
 
+/*
+ * Block queues.  A thread sleeps on at most one queue at a time, in
+ * the lfqueue node it owns, and sleepers are woken one at a time in
+ * FIFO order.  There is no wake-n or wake-all since nothing needs it,
+ * no priority order since threads have no priorities, and no timeout:
+ * a thread with a deadline sleeps on the timeq instead.
+ */
 static void
 block_queue_callback(struct bmk_thread *prev, struct bmk_block_data *_block)
 {
 	struct bmk_block_queue *block = bmk_container_of(_block, struct bmk_block_queue, header);
-	struct lfqueue *queue = (struct lfqueue *) block->_queue;
 
-	if (!lfqueue_enqueue(queue, prev->bt_block_node, true))
-		bmk_sched_wake(prev);
+	bmk_block_queue_insert(block, prev);
 }
 
 void
@@ -860,19 +1498,38 @@ bmk_block_queue_destroy(struct bmk_block_queue *block)
 	struct lfqueue *queue = (struct lfqueue *) block->_queue;
 	struct lfqueue_node *node = lfqueue_sentinel(queue);
 
-	lfring_enqueue(nodes, BMK_MAX_BLOCKQ_ORDER, node->index, false);
+	lfring_enqueue(nodes, blockq_order, node->index, false);
 }
 
+/*
+ * Queue a thread which is blocked elsewhere as if it had blocked on
+ * block itself.  Lets callers move sleepers between queues without
+ * waking them up in between.
+ */
+void
+bmk_block_queue_insert(struct bmk_block_queue *block,
+	struct bmk_thread *thread)
+{
+	struct lfqueue *queue = (struct lfqueue *) block->_queue;
+
+	if (!lfqueue_enqueue(queue, thread->bt_block_node, true))
+		bmk_sched_wake(thread);
+}
+
+/*
+ * Wake one sleeper.  If there is none yet, the wakeup is remembered
+ * and the next thread to block on the queue returns immediately.
+ */
 void
 bmk_block_queue_wake(struct bmk_block_queue *block)
 {
 	struct lfqueue *queue = (struct lfqueue *) block->_queue;
 	struct lfqueue_node *node = lfqueue_dequeue(queue, true);
 
+	/* the waker keeps running, may be an interrupt handler */
 	if (node != NULL) {
 		struct bmk_thread *thread = node->object;
 		thread->bt_block_node = node;
-		lfring_enqueue(runq[thread->bt_cpuidx], BMK_MAX_THREADS_ORDER,
-				thread->bt_idx, false);
+		bmk_sched_wake(thread);
 	}
 }
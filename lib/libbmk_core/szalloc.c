@@ -0,0 +1,639 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Size-class allocator for user memory.
+ *
+ * Small requests are rounded up to one of a set of size classes which
+ * are 16 bytes apart up to 64 bytes and four per power of two above
+ * that, so at most 25% of an object is lost to rounding.  Objects of
+ * a class are carved from spans of pages sized so that little is left
+ * over at the end of a span.  Larger requests get whole pages, which
+ * need not be a power of two.  There is no header in front of
+ * objects: span descriptors live elsewhere and are found through a
+ * page map.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/null.h>
+#include <bmk-core/memalloc.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/printf.h>
+#include <bmk-core/queue.h>
+#include <bmk-core/simple_lock.h>
+#include <bmk-core/string.h>
+
+#include <bmk-pcpu/pcpu.h>
+
+#define SZ_MINSHIFT	4
+#define SZ_MIN		(1UL<<SZ_MINSHIFT)
+#define SZ_MAXSMALL	(16UL*1024)
+#define SZ_SPANMAX	32		/* max pages per small span */
+
+/*
+ * Large allocations of at least SZ_HUGEMIN start on a huge page
+ * boundary, so they take the fewest large TLB entries.  The length is
+ * not padded, the tail of the last huge page stays usable by others.
+ */
+#define SZ_HUGEMIN	BMK_PGALLOC_HUGE_SIZE
+
+/* 4 classes up to 64 bytes, then 4 per doubling up to SZ_MAXSMALL */
+#define SZ_NCLASSES	(4 + 4*(14 - 6))
+#define SZ_LARGE	SZ_NCLASSES
+
+struct szfree {
+	struct szfree *next;
+};
+
+struct szspan {
+	LIST_ENTRY(szspan) sp_entries;
+	char *sp_base;
+	unsigned long sp_npages;
+	unsigned int sp_class;
+	unsigned int sp_nfree;		/* objects on sp_free + not carved */
+	unsigned int sp_carved;		/* objects handed out at least once */
+	struct szfree *sp_free;
+};
+LIST_HEAD(szspanlist, szspan);
+
+struct szclass {
+	bmk_simple_lock_t sc_lock;
+	struct szspanlist sc_partial;	/* spans with free objects */
+	struct szspan *sc_spare;	/* one completely free span */
+	unsigned long sc_size;
+	unsigned long sc_npages;
+	unsigned int sc_nobjs;
+	unsigned int sc_maglimit;
+	unsigned long sc_nspans;
+	unsigned long sc_inuse;
+	unsigned long sc_peak;
+	unsigned long sc_nallocs;
+};
+static struct szclass szclasses[SZ_NCLASSES];
+
+/*
+ * Per-CPU magazines in front of the classes, as in memalloc.c.
+ * Objects move between a magazine and the spans in batches of half a
+ * magazine, so sc_lock is taken once per batch instead of once per
+ * object.  A magazine holds at most SZ_MAGBYTES worth of objects.
+ * Magazines are only used from thread context, which is never
+ * preempted, so they need no locking.
+ *
+ * sc_inuse counts objects taken from spans, so it includes objects
+ * sitting in magazines.
+ */
+#define SZ_MAGMAX	32
+#define SZ_MAGBYTES	(32UL*1024)
+bmk_ctassert(SZ_MAGBYTES / SZ_MAXSMALL >= 2);
+
+struct szmag {
+	unsigned int sm_count;
+	void *sm_objs[SZ_MAGMAX];
+};
+
+struct szcache {
+	struct szmag sz_mags[SZ_NCLASSES];
+	__attribute__ ((aligned(BMK_PCPU_L1_SIZE))) char _pad[0];
+};
+static struct szcache szcache[BMK_CORE_MAXCPUS];
+
+static inline struct szmag *
+szmag(unsigned int class)
+{
+	return &szcache[bmk_get_cpu_info()->cpu].sz_mags[class];
+}
+
+static bmk_simple_lock_t szlarge_lock =
+    BMK_SIMPLE_LOCK_INITIALIZER_FLAGS(BMK_SIMPLE_LOCK_PV);
+static unsigned long szlarge_npages, szlarge_count;
+
+/*
+ * Page number to span.  Allocated on first use, since the allocator
+ * is initialized before the page allocator on some platforms.
+ */
+static struct szspan **pagemap;
+static unsigned long pagemap_min, pagemap_max;
+static bmk_simple_lock_t szinit_lock = BMK_SIMPLE_LOCK_INITIALIZER;
+static int szinited;
+
+#define addr2page(_a_) \
+    (((unsigned long)(_a_) - pagemap_min) >> BMK_PCPU_PAGE_SHIFT)
+
+static unsigned int
+size2class(unsigned long size)
+{
+	unsigned long k;
+
+	if (size <= 4*SZ_MIN)
+		return size == 0 ? 0 : (size-1) >> SZ_MINSHIFT;
+
+	/* 2^k < size <= 2^(k+1), classes 2^k + i*2^(k-2), i=1..4 */
+	k = 8*sizeof(size) - 1 - __builtin_clzl(size-1);
+	return 4 + (k-6)*4 + ((size - 1 - (1UL<<k)) >> (k-2));
+}
+
+static void
+szinit(void)
+{
+	struct szclass *sc;
+	unsigned long min, max, span, npages, nmap;
+	unsigned int i;
+
+	bmk_simple_lock_enter(&szinit_lock);
+	if (szinited) {
+		bmk_simple_lock_exit(&szinit_lock);
+		return;
+	}
+
+	bmk_pgalloc_bounds(&min, &max);
+	nmap = ((max - min) >> BMK_PCPU_PAGE_SHIFT) * sizeof(*pagemap);
+	pagemap = bmk_pgalloc_npages(bmk_round_page(nmap)
+	    >> BMK_PCPU_PAGE_SHIFT, BMK_PCPU_PAGE_SIZE);
+	if (pagemap == NULL)
+		bmk_platform_halt("szalloc: cannot allocate page map");
+	pagemap_min = min;
+	pagemap_max = max;
+
+	for (i = 0; i < SZ_NCLASSES; i++) {
+		sc = &szclasses[i];
+		if (i < 4) {
+			sc->sc_size = (i+1) * SZ_MIN;
+		} else {
+			unsigned long k = 6 + (i-4)/4;
+			sc->sc_size = (1UL<<k) + ((i-4)%4 + 1) * (1UL<<(k-2));
+		}
+		bmk_assert(size2class(sc->sc_size) == i);
+
+		/* smallest span leaving at most 1/8 unused */
+		for (npages = 1; npages < SZ_SPANMAX; npages++) {
+			span = npages * BMK_PCPU_PAGE_SIZE;
+			if (span / sc->sc_size >= 2
+			    && 8 * (span % sc->sc_size) <= span)
+				break;
+		}
+		sc->sc_npages = npages;
+		sc->sc_nobjs = (npages * BMK_PCPU_PAGE_SIZE) / sc->sc_size;
+		sc->sc_maglimit = SZ_MAGBYTES / sc->sc_size;
+		if (sc->sc_maglimit > SZ_MAGMAX)
+			sc->sc_maglimit = SZ_MAGMAX;
+		bmk_simple_lock_init_flags(&sc->sc_lock, BMK_SIMPLE_LOCK_PV);
+		LIST_INIT(&sc->sc_partial);
+	}
+	bmk_assert(szclasses[SZ_NCLASSES-1].sc_size == SZ_MAXSMALL);
+
+	__atomic_store_n(&szinited, 1, __ATOMIC_RELEASE);
+	bmk_simple_lock_exit(&szinit_lock);
+}
+
+static void
+pagemap_set(struct szspan *sp)
+{
+	unsigned long pg = addr2page(sp->sp_base), i;
+
+	bmk_assert((unsigned long)sp->sp_base >= pagemap_min
+	    && (unsigned long)sp->sp_base < pagemap_max);
+	for (i = 0; i < sp->sp_npages; i++)
+		pagemap[pg + i] = sp;
+}
+
+static struct szspan *
+pagemap_get(void *p)
+{
+
+	if ((unsigned long)p < pagemap_min || (unsigned long)p >= pagemap_max)
+		return NULL;
+	return pagemap[addr2page(p)];
+}
+
+static struct szspan *
+span_alloc(unsigned long npages, unsigned long align, unsigned int class,
+	int zero)
+{
+	struct szspan *sp;
+
+	sp = bmk_memalloc(sizeof(*sp), 0, BMK_MEMWHO_WIREDBMK);
+	if (sp == NULL)
+		return NULL;
+	sp->sp_base = zero ? bmk_pgalloc_npages_zero(npages, align)
+	    : bmk_pgalloc_npages(npages, align);
+	if (sp->sp_base == NULL) {
+		bmk_memfree(sp, BMK_MEMWHO_WIREDBMK);
+		return NULL;
+	}
+	sp->sp_npages = npages;
+	sp->sp_class = class;
+	sp->sp_free = NULL;
+	sp->sp_carved = 0;
+	sp->sp_nfree = 0;
+	pagemap_set(sp);
+
+	return sp;
+}
+
+static void
+span_free(struct szspan *sp)
+{
+	unsigned long pg = addr2page(sp->sp_base), i;
+
+	for (i = 0; i < sp->sp_npages; i++)
+		pagemap[pg + i] = NULL;
+	bmk_pgfree_npages(sp->sp_base, sp->sp_npages);
+	bmk_memfree(sp, BMK_MEMWHO_WIREDBMK);
+}
+
+/*
+ * Take one object off the spans of a class.  Called with sc_lock held,
+ * which is dropped while allocating a new span.
+ */
+static void *
+smallget(struct szclass *sc, unsigned int class)
+{
+	struct szspan *sp;
+	struct szfree *obj;
+
+	if ((sp = LIST_FIRST(&sc->sc_partial)) == NULL) {
+		if ((sp = sc->sc_spare) != NULL) {
+			sc->sc_spare = NULL;
+		} else {
+			bmk_simple_lock_exit(&sc->sc_lock);
+			sp = span_alloc(sc->sc_npages, BMK_PCPU_PAGE_SIZE,
+			    class, 0);
+			bmk_simple_lock_enter(&sc->sc_lock);
+			if (sp == NULL)
+				return NULL;
+			sp->sp_nfree = sc->sc_nobjs;
+			sc->sc_nspans++;
+		}
+		LIST_INSERT_HEAD(&sc->sc_partial, sp, sp_entries);
+	}
+
+	if ((obj = sp->sp_free) != NULL) {
+		sp->sp_free = obj->next;
+	} else {
+		obj = (void *)(sp->sp_base + sp->sp_carved * sc->sc_size);
+		sp->sp_carved++;
+	}
+	if (--sp->sp_nfree == 0)
+		LIST_REMOVE(sp, sp_entries);
+	if (++sc->sc_inuse > sc->sc_peak)
+		sc->sc_peak = sc->sc_inuse;
+	sc->sc_nallocs++;
+
+	return obj;
+}
+
+/*
+ * Put an object back on its span.  Called with sc_lock held.  Returns
+ * the span if it became free and should be released.
+ */
+static struct szspan *
+smallput(struct szclass *sc, struct szspan *sp, void *p)
+{
+	struct szfree *obj = p;
+
+	obj->next = sp->sp_free;
+	sp->sp_free = obj;
+	if (sp->sp_nfree++ == 0)
+		LIST_INSERT_HEAD(&sc->sc_partial, sp, sp_entries);
+	sc->sc_inuse--;
+
+	/* keep one free span around, give the rest back */
+	if (sp->sp_nfree == sc->sc_nobjs) {
+		LIST_REMOVE(sp, sp_entries);
+		sp->sp_free = NULL;
+		sp->sp_carved = 0;
+		if (sc->sc_spare == NULL) {
+			sc->sc_spare = sp;
+		} else {
+			sc->sc_nspans--;
+			return sp;
+		}
+	}
+	return NULL;
+}
+
+/* Fill half of an empty magazine from the spans. */
+static unsigned int
+magrefill(struct szmag *mag, unsigned int class)
+{
+	struct szclass *sc = &szclasses[class];
+	unsigned int n = sc->sc_maglimit / 2;
+	void *obj;
+
+	bmk_simple_lock_enter(&sc->sc_lock);
+	while (mag->sm_count < n) {
+		if ((obj = smallget(sc, class)) == NULL)
+			break;
+		mag->sm_objs[mag->sm_count++] = obj;
+	}
+	bmk_simple_lock_exit(&sc->sc_lock);
+
+	return mag->sm_count;
+}
+
+/* Return half of a full magazine to the spans. */
+static void
+magflush(struct szmag *mag, unsigned int class)
+{
+	struct szclass *sc = &szclasses[class];
+	struct szspanlist release = LIST_HEAD_INITIALIZER(release);
+	struct szspan *sp;
+	unsigned int n = sc->sc_maglimit / 2;
+	void *p;
+
+	bmk_simple_lock_enter(&sc->sc_lock);
+	while (mag->sm_count > n) {
+		p = mag->sm_objs[--mag->sm_count];
+		if ((sp = smallput(sc, pagemap_get(p), p)) != NULL)
+			LIST_INSERT_HEAD(&release, sp, sp_entries);
+	}
+	bmk_simple_lock_exit(&sc->sc_lock);
+
+	while ((sp = LIST_FIRST(&release)) != NULL) {
+		LIST_REMOVE(sp, sp_entries);
+		span_free(sp);
+	}
+}
+
+static void *
+smallalloc(unsigned int class)
+{
+	struct szmag *mag = szmag(class);
+
+	if (mag->sm_count == 0 && magrefill(mag, class) == 0)
+		return NULL;
+
+	bmk_memstat_alloc(BMK_MEMWHO_USER, szclasses[class].sc_size);
+	return mag->sm_objs[--mag->sm_count];
+}
+
+static void
+smallfree(struct szspan *sp, void *p)
+{
+	struct szmag *mag = szmag(sp->sp_class);
+
+	if (mag->sm_count == szclasses[sp->sp_class].sc_maglimit)
+		magflush(mag, sp->sp_class);
+	mag->sm_objs[mag->sm_count++] = p;
+
+	bmk_memstat_free(BMK_MEMWHO_USER, szclasses[sp->sp_class].sc_size);
+}
+
+static unsigned long
+largepages(unsigned long nbytes)
+{
+	unsigned long npages;
+
+	npages = bmk_round_page(nbytes) >> BMK_PCPU_PAGE_SHIFT;
+	if (npages == 0)
+		npages = 1;
+	return npages;
+}
+
+static void *
+largealloc(unsigned long nbytes, unsigned long align, int zero)
+{
+	struct szspan *sp;
+	unsigned long npages;
+
+	npages = largepages(nbytes);
+	if (nbytes >= SZ_HUGEMIN && align < BMK_PGALLOC_HUGE_SIZE)
+		align = BMK_PGALLOC_HUGE_SIZE;
+	if ((sp = span_alloc(npages, align, SZ_LARGE, zero)) == NULL)
+		return NULL;
+
+	bmk_simple_lock_enter(&szlarge_lock);
+	szlarge_npages += npages;
+	szlarge_count++;
+	bmk_simple_lock_exit(&szlarge_lock);
+	bmk_memstat_alloc(BMK_MEMWHO_USER, npages << BMK_PCPU_PAGE_SHIFT);
+
+	return sp->sp_base;
+}
+
+static void
+largefree(struct szspan *sp)
+{
+
+	bmk_simple_lock_enter(&szlarge_lock);
+	szlarge_npages -= sp->sp_npages;
+	szlarge_count--;
+	bmk_simple_lock_exit(&szlarge_lock);
+	bmk_memstat_free(BMK_MEMWHO_USER, sp->sp_npages << BMK_PCPU_PAGE_SHIFT);
+
+	span_free(sp);
+}
+
+void *
+bmk_szalloc(unsigned long nbytes, unsigned long align)
+{
+	unsigned int class;
+
+	if (align & (align-1))
+		return NULL;
+	if (align < SZ_MIN)
+		align = SZ_MIN;
+	if (!__atomic_load_n(&szinited, __ATOMIC_ACQUIRE))
+		szinit();
+
+	/*
+	 * Spans are page aligned, so objects of a class are aligned
+	 * to any power of two dividing the class size.
+	 */
+	if (nbytes <= SZ_MAXSMALL && align < BMK_PCPU_PAGE_SIZE) {
+		for (class = size2class(nbytes); class < SZ_NCLASSES; class++) {
+			if ((szclasses[class].sc_size & (align-1)) == 0)
+				return smallalloc(class);
+		}
+	}
+
+	if (align < BMK_PCPU_PAGE_SIZE)
+		align = BMK_PCPU_PAGE_SIZE;
+	return largealloc(nbytes, align, 0);
+}
+
+void *
+bmk_szcalloc(unsigned long n, unsigned long size)
+{
+	void *v;
+	unsigned long tot = n * size;
+
+	if (size != 0 && tot / size != n)
+		return NULL;
+
+	/* whole pages come zeroed from the page allocator */
+	if (tot > SZ_MAXSMALL) {
+		if (!__atomic_load_n(&szinited, __ATOMIC_ACQUIRE))
+			szinit();
+		return largealloc(tot, BMK_PCPU_PAGE_SIZE, 1);
+	}
+
+	if ((v = bmk_szalloc(tot, SZ_MIN)) != NULL)
+		bmk_memset(v, 0, tot);
+	return v;
+}
+
+static struct szspan *
+ptr2span(void *p)
+{
+	struct szspan *sp = pagemap_get(p);
+
+	if (sp == NULL || (sp->sp_class == SZ_LARGE && p != sp->sp_base)) {
+		bmk_printf("bmk_szfree: invalid pointer %p\n", p);
+		bmk_platform_halt("szalloc error");
+	}
+	return sp;
+}
+
+/* Usable size of an allocation. */
+unsigned long
+bmk_szsize(void *p)
+{
+	struct szspan *sp = ptr2span(p);
+
+	if (sp->sp_class == SZ_LARGE)
+		return sp->sp_npages << BMK_PCPU_PAGE_SHIFT;
+	return szclasses[sp->sp_class].sc_size;
+}
+
+void
+bmk_szfree(void *p)
+{
+	struct szspan *sp;
+
+	if (p == NULL)
+		return;
+	sp = ptr2span(p);
+	if (sp->sp_class == SZ_LARGE)
+		largefree(sp);
+	else
+		smallfree(sp, p);
+}
+
+/*
+ * Resize a large allocation in place: give back pages off the end,
+ * or take the free pages right after it.  Returns nonzero on success.
+ */
+static int
+largeresize(struct szspan *sp, unsigned long nbytes)
+{
+	unsigned long npages, pg, i;
+
+	npages = largepages(nbytes);
+	pg = addr2page(sp->sp_base);
+	if (npages < sp->sp_npages) {
+		for (i = npages; i < sp->sp_npages; i++)
+			pagemap[pg + i] = NULL;
+		bmk_pgfree_npages(sp->sp_base + npages*BMK_PCPU_PAGE_SIZE,
+		    sp->sp_npages - npages);
+	} else if (npages > sp->sp_npages) {
+		if (!bmk_pgalloc_tryextend(sp->sp_base, sp->sp_npages, npages))
+			return 0;
+		for (i = sp->sp_npages; i < npages; i++)
+			pagemap[pg + i] = sp;
+	}
+
+	bmk_simple_lock_enter(&szlarge_lock);
+	szlarge_npages += npages - sp->sp_npages;
+	bmk_simple_lock_exit(&szlarge_lock);
+	if (npages > sp->sp_npages)
+		bmk_memstat_alloc(BMK_MEMWHO_USER,
+		    (npages - sp->sp_npages) << BMK_PCPU_PAGE_SHIFT);
+	else
+		bmk_memstat_free(BMK_MEMWHO_USER,
+		    (sp->sp_npages - npages) << BMK_PCPU_PAGE_SHIFT);
+	sp->sp_npages = npages;
+
+	return 1;
+}
+
+void *
+bmk_szrealloc(void *p, unsigned long nbytes)
+{
+	struct szspan *sp;
+	unsigned long oldsize;
+	void *np;
+
+	if (p == NULL)
+		return bmk_szalloc(nbytes, SZ_MIN);
+	if (nbytes == 0) {
+		bmk_szfree(p);
+		return NULL;
+	}
+
+	/*
+	 * Stay put if the new size still maps to the same class.
+	 * Large allocations are resized in place when possible.
+	 */
+	sp = ptr2span(p);
+	oldsize = bmk_szsize(p);
+	if (sp->sp_class == SZ_LARGE) {
+		if (nbytes > SZ_MAXSMALL && largeresize(sp, nbytes))
+			return p;
+	} else if (nbytes <= oldsize
+	    && size2class(nbytes) == sp->sp_class) {
+		return p;
+	}
+
+	if ((np = bmk_szalloc(nbytes, SZ_MIN)) == NULL)
+		return NULL;
+	bmk_memcpy(np, p, nbytes < oldsize ? nbytes : oldsize);
+	bmk_szfree(p);
+	return np;
+}
+
+void
+bmk_szalloc_printstats(void)
+{
+	struct szclass *sc;
+	unsigned long totused = 0, totspans = 0, cached, cpu;
+	unsigned int i;
+
+	if (!szinited)
+		return;
+
+	bmk_printf("Size-class allocation statistics\n");
+	bmk_printf("%8s %6s %8s %8s %8s %8s %10s\n", "size", "pages",
+	    "spans", "inuse", "cached", "peak", "allocs");
+	for (i = 0; i < SZ_NCLASSES; i++) {
+		sc = &szclasses[i];
+		if (sc->sc_nallocs == 0)
+			continue;
+		cached = 0;
+		for (cpu = 0; cpu < bmk_numcpus && cpu < BMK_CORE_MAXCPUS;
+		    cpu++)
+			cached += szcache[cpu].sz_mags[i].sm_count;
+		bmk_printf("%8lu %6lu %8lu %8lu %8lu %8lu %10lu\n",
+		    sc->sc_size, sc->sc_npages, sc->sc_nspans, sc->sc_inuse,
+		    cached, sc->sc_peak, sc->sc_nallocs);
+		totused += sc->sc_inuse * sc->sc_size;
+		totspans += sc->sc_nspans * sc->sc_npages;
+	}
+	bmk_printf("\tsmall in use: %lukB in %lukB of spans\n",
+	    totused/1024, (totspans << BMK_PCPU_PAGE_SHIFT)/1024);
+	bmk_printf("\tlarge: %lu allocations, %lukB\n", szlarge_count,
+	    (szlarge_npages << BMK_PCPU_PAGE_SHIFT)/1024);
+}
@@ -28,7 +28,10 @@
 #include <bmk-core/sched.h>
 #include <bmk-core/memalloc.h>
 #include <bmk-core/errno.h>
+#include <bmk-core/lockstat.h>
+#include <bmk-core/simple_lock.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <bmk-rumpuser/core_types.h>
@@ -42,6 +45,8 @@ TAILQ_HEAD(waithead, waiter);
 struct waiter {
 	struct bmk_thread *thread;
 	void (*wake) (struct bmk_thread *);
+	struct rumpuser_mtx *mtx;	/* to morph onto, or NULL */
+	bool morphed;
 	TAILQ_ENTRY(waiter) entries;
 };
 
@@ -73,14 +78,94 @@ rumpuser_thread_join(void *p)
 	return 0;
 }
 
+/*
+ * counter is the owner plus the number of sleepers.  Sleepers are
+ * handed the lock directly by rumpuser_mutex_exit().
+ */
 struct rumpuser_mtx {
 	struct bmk_block_queue block;
 	_Atomic(unsigned long) counter;
 	struct lwp *owner;
+	_Atomic(struct bmk_thread *) othread;
 	int flags;
+#ifdef BMK_LOCKSTAT
+	struct bmk_lockstat_hold lockstat;
+#endif
 	_Alignas(BMK_PCPU_L1_SIZE) char _pad[0];
 };
 
+/*
+ * Spin waits back off exponentially, doubling the number of pauses
+ * between attempts up to MTX_BACKOFF_MAX.  Waits which go on for
+ * long yield the vCPU, see bmk_spin_wait().
+ */
+#define MTX_BACKOFF_MIN	4
+#define MTX_BACKOFF_MAX	256
+
+static inline unsigned int
+mtx_backoff(unsigned int backoff, unsigned long *spins)
+{
+	unsigned int i;
+
+	for (i = 0; i < backoff; i++)
+		bmk_spin_wait(spins);
+	return backoff < MTX_BACKOFF_MAX ? backoff << 1 : backoff;
+}
+
+static inline int
+mtx_tryacquire(struct rumpuser_mtx *mtx)
+{
+	unsigned long counter = 0;
+
+	return atomic_load_explicit(&mtx->counter, memory_order_relaxed) == 0
+	    && atomic_compare_exchange_strong(&mtx->counter, &counter, 1);
+}
+
+/*
+ * Adaptive part of mutex_enter: spin for a short while as long as
+ * the owner runs on another CPU and nobody sleeps on the lock, in
+ * which case the lock would be handed to a sleeper anyway.  Returns
+ * nonzero if the lock was taken.
+ */
+static int
+mtx_spin(struct rumpuser_mtx *mtx)
+{
+	struct bmk_thread *othread;
+	unsigned long counter;
+	unsigned int backoff = MTX_BACKOFF_MIN;
+	unsigned long spins = 0;
+
+	if (bmk_numcpus == 1)
+		return 0;
+
+	for (;;) {
+		counter = atomic_load_explicit(&mtx->counter,
+		    memory_order_relaxed);
+		if (counter == 0) {
+			if (atomic_compare_exchange_weak(&mtx->counter,
+			    &counter, 1))
+				return 1;
+			continue;
+		}
+		if (counter != 1 || backoff == MTX_BACKOFF_MAX)
+			return 0;
+		/* NULL while the new owner is still on its way in */
+		othread = atomic_load_explicit(&mtx->othread,
+		    memory_order_relaxed);
+		if (othread != NULL && !bmk_sched_oncpu(othread))
+			return 0;
+		backoff = mtx_backoff(backoff, &spins);
+	}
+}
+
+static inline void
+mtx_setowner(struct rumpuser_mtx *mtx, struct lwp *owner)
+{
+	mtx->owner = owner;
+	atomic_store_explicit(&mtx->othread, bmk_current,
+	    memory_order_relaxed);
+}
+
 void
 rumpuser_mutex_init(struct rumpuser_mtx **mtxp, int flags)
 {
@@ -92,7 +177,11 @@ rumpuser_mutex_init(struct rumpuser_mtx **mtxp, int flags)
 	bmk_block_queue_init(&mtx->block);
 	atomic_init(&mtx->counter, 0);
 	mtx->owner = NULL;
+	atomic_init(&mtx->othread, NULL);
 	mtx->flags = flags;
+#ifdef BMK_LOCKSTAT
+	mtx->lockstat.lh_ent = NULL;
+#endif
 	*mtxp = mtx;
 }
 
@@ -107,6 +196,7 @@ rumpuser_mutex_enter(struct rumpuser_mtx *mtx)
 {
 	struct lwp *owner = rumpuser_curlwp();
 	int nlocks;
+	BMK_LOCKSTAT_TIMER(wait);
 
 	if (mtx->flags & RUMPUSER_MTX_SPIN) {
 		rumpuser_mutex_enter_nowrap(mtx);
@@ -114,13 +204,20 @@ rumpuser_mutex_enter(struct rumpuser_mtx *mtx)
 	}
 
 	bmk_assert(mtx->flags & RUMPUSER_MTX_KMUTEX);
-	if (atomic_fetch_add(&mtx->counter, 1) != 0) {
-		rumpkern_unsched(&nlocks, NULL);
-		bmk_sched_blockprepare();
-		bmk_sched_block(&mtx->block.header);
-		rumpkern_sched(nlocks, NULL);
+	if (!mtx_tryacquire(mtx)) {
+		BMK_LOCKSTAT_START(wait);
+		if (!mtx_spin(mtx)
+		    && atomic_fetch_add(&mtx->counter, 1) != 0) {
+			rumpkern_unsched(&nlocks, NULL);
+			bmk_sched_blockprepare();
+			bmk_sched_block(&mtx->block.header);
+			rumpkern_sched(nlocks, NULL);
+		}
+		BMK_LOCKSTAT_STOP(wait);
 	}
-	mtx->owner = owner;
+	mtx_setowner(mtx, owner);
+	BMK_LOCKSTAT_ACQUIRED(&mtx->lockstat, mtx, BMK_LOCKSTAT_MUTEX, wait,
+	    __builtin_return_address(0));
 }
 
 /* A version of mutex_enter that avoids rumpkern_unsched/rumpkern_sched. */
@@ -128,6 +225,7 @@ static void
 cv_mutex_enter(struct rumpuser_mtx *mtx)
 {
 	struct lwp *owner = rumpuser_curlwp();
+	BMK_LOCKSTAT_TIMER(wait);
 
 	if (mtx->flags & RUMPUSER_MTX_SPIN) {
 		rumpuser_mutex_enter_nowrap(mtx);
@@ -135,11 +233,18 @@ cv_mutex_enter(struct rumpuser_mtx *mtx)
 	}
 
 	bmk_assert(mtx->flags & RUMPUSER_MTX_KMUTEX);
-	if (atomic_fetch_add(&mtx->counter, 1) != 0) {
-		bmk_sched_blockprepare();
-		bmk_sched_block(&mtx->block.header);
+	if (!mtx_tryacquire(mtx)) {
+		BMK_LOCKSTAT_START(wait);
+		if (!mtx_spin(mtx)
+		    && atomic_fetch_add(&mtx->counter, 1) != 0) {
+			bmk_sched_blockprepare();
+			bmk_sched_block(&mtx->block.header);
+		}
+		BMK_LOCKSTAT_STOP(wait);
 	}
-	mtx->owner = owner;
+	mtx_setowner(mtx, owner);
+	BMK_LOCKSTAT_ACQUIRED(&mtx->lockstat, mtx, BMK_LOCKSTAT_MUTEX, wait,
+	    BMK_LOCKSTAT_HERE());
 }
 
 void
@@ -147,13 +252,23 @@ rumpuser_mutex_enter_nowrap(struct rumpuser_mtx *mtx)
 {
 	struct lwp *owner = rumpuser_curlwp();
 	unsigned long counter;
+	unsigned int backoff = MTX_BACKOFF_MIN;
+	unsigned long spins = 0;
+	BMK_LOCKSTAT_TIMER(wait);
 
-	do {
-		while ((counter = atomic_load(&mtx->counter)) != 0)
-			bmk_cpu_relax();
-	} while (!atomic_compare_exchange_weak(&mtx->counter, &counter, 1));
+	if (!mtx_tryacquire(mtx)) {
+		BMK_LOCKSTAT_START(wait);
+		do {
+			while ((counter = atomic_load(&mtx->counter)) != 0)
+				backoff = mtx_backoff(backoff, &spins);
+		} while (!atomic_compare_exchange_weak(&mtx->counter,
+		    &counter, 1));
+		BMK_LOCKSTAT_STOP(wait);
+	}
 
-	mtx->owner = owner;
+	mtx_setowner(mtx, owner);
+	BMK_LOCKSTAT_ACQUIRED(&mtx->lockstat, mtx, BMK_LOCKSTAT_SPIN, wait,
+	    __builtin_return_address(0));
 }
 
 int
@@ -168,14 +283,18 @@ rumpuser_mutex_tryenter(struct rumpuser_mtx *mtx)
 			return BMK_EBUSY;
 	} while (!atomic_compare_exchange_weak(&mtx->counter, &counter, 1));
 
-	mtx->owner = owner;
+	mtx_setowner(mtx, owner);
+	BMK_LOCKSTAT_ACQUIRED(&mtx->lockstat, mtx, BMK_LOCKSTAT_MUTEX, 0,
+	    __builtin_return_address(0));
 	return 0;
 }
 
 void
 rumpuser_mutex_exit(struct rumpuser_mtx *mtx)
 {
+	BMK_LOCKSTAT_RELEASED(&mtx->lockstat);
 	mtx->owner = NULL;
+	atomic_store_explicit(&mtx->othread, NULL, memory_order_relaxed);
 	if (atomic_fetch_sub(&mtx->counter, 1) != 1)
 		bmk_block_queue_wake(&mtx->block);
 }
@@ -194,28 +313,122 @@ rumpuser_mutex_owner(struct rumpuser_mtx *mtx, struct lwp **lp)
 	*lp = mtx->owner;
 }
 
-enum lock_rw_type { LOCK_RW_UNKNOWN, LOCK_RW_WRITER, LOCK_RW_READER };
+/*
+ * Reader-writer locks count readers in per-CPU slots so that readers
+ * on different CPUs do not share a cache line.  A reader may exit on
+ * another CPU than it entered on, only the sum over all slots is
+ * meaningful.
+ *
+ * Writers are serialized by wmtx, which they hold until they exit.
+ * A writer announces itself in wstate and then waits for the slots to
+ * drain.  Readers which see a writer back off and queue up on wmtx
+ * behind it, so writers are preferred and cannot be starved.  The
+ * reader which drains the slots wakes a writer sleeping on wblock if
+ * wwait says there is one.
+ */
+#define RW_MAXSLOTS	16
 
-struct rumpuser_rw {
-	struct rumpuser_mtx *access_mtx;
-	struct rumpuser_mtx *wait_mtx;
-	_Atomic(unsigned long) readers;
-	_Atomic(unsigned long) type;
+#define RW_WPENDING	1
+#define RW_WHELD	2
+
+struct rw_slot {
+	_Atomic(long) count;
 	_Alignas(BMK_PCPU_L1_SIZE) char _pad[0];
 };
 
+struct rumpuser_rw {
+	struct bmk_block_queue wblock;
+	struct rumpuser_mtx *wmtx;
+	_Atomic(unsigned long) wstate;
+	_Atomic(unsigned long) wwait;
+	unsigned long nslots;
+	_Alignas(BMK_PCPU_L1_SIZE) struct rw_slot slots[];
+};
+
+static inline _Atomic(long) *
+rw_slot(struct rumpuser_rw *rw)
+{
+	return &rw->slots[bmk_get_cpu_info()->cpu % rw->nslots].count;
+}
+
+static long
+rw_readers(struct rumpuser_rw *rw)
+{
+	unsigned long i;
+	long sum = 0;
+
+	for (i = 0; i < rw->nslots; i++)
+		sum += atomic_load(&rw->slots[i].count);
+	return sum;
+}
+
+static void
+rw_readexit(struct rumpuser_rw *rw)
+{
+	atomic_fetch_sub(rw_slot(rw), 1);
+	if (atomic_load(&rw->wstate) == RW_WPENDING
+	    && atomic_exchange(&rw->wwait, 0) != 0)
+		bmk_block_queue_wake(&rw->wblock);
+}
+
+static int
+rw_tryread(struct rumpuser_rw *rw)
+{
+	atomic_fetch_add(rw_slot(rw), 1);
+	if (atomic_load(&rw->wstate) == 0)
+		return 1;
+	rw_readexit(rw);
+	return 0;
+}
+
+/*
+ * Called with wmtx held and wstate set to RW_WPENDING.  Spin for a
+ * while in case the remaining readers are about to leave, then
+ * sleep until the last one does.
+ */
+static void
+rw_drain(struct rumpuser_rw *rw)
+{
+	unsigned int backoff = MTX_BACKOFF_MIN;
+	unsigned long spins = 0;
+	int nlocks;
+
+	while (rw_readers(rw) != 0) {
+		if (backoff == MTX_BACKOFF_MAX || bmk_numcpus == 1)
+			break;
+		backoff = mtx_backoff(backoff, &spins);
+	}
+
+	for (;;) {
+		atomic_store(&rw->wwait, 1);
+		/* if a reader took wwait, its wakeup must be consumed */
+		if (rw_readers(rw) == 0 && atomic_exchange(&rw->wwait, 0) != 0)
+			break;
+		rumpkern_unsched(&nlocks, NULL);
+		bmk_sched_blockprepare();
+		bmk_sched_block(&rw->wblock.header);
+		rumpkern_sched(nlocks, NULL);
+	}
+}
+
 void
 rumpuser_rw_init(struct rumpuser_rw **rwp)
 {
 	struct rumpuser_rw *rw;
+	unsigned long i, nslots;
 
-	rw = bmk_memalloc(sizeof(*rw), BMK_PCPU_L1_SIZE, BMK_MEMWHO_WIREDBMK);
+	nslots = bmk_numcpus < RW_MAXSLOTS ? bmk_numcpus : RW_MAXSLOTS;
+	rw = bmk_memalloc(sizeof(*rw) + nslots * sizeof(struct rw_slot),
+	    BMK_PCPU_L1_SIZE, BMK_MEMWHO_WIREDBMK);
 	if (!rw)
 		bmk_platform_halt("cannot allocate a RW lock");
-	atomic_init(&rw->readers, 0);
-	atomic_init(&rw->type, LOCK_RW_UNKNOWN);
-	rumpuser_mutex_init(&rw->access_mtx, RUMPUSER_MTX_KMUTEX);
-	rumpuser_mutex_init(&rw->wait_mtx, RUMPUSER_MTX_KMUTEX);
+	bmk_block_queue_init(&rw->wblock);
+	rumpuser_mutex_init(&rw->wmtx, RUMPUSER_MTX_KMUTEX);
+	atomic_init(&rw->wstate, 0);
+	atomic_init(&rw->wwait, 0);
+	rw->nslots = nslots;
+	for (i = 0; i < nslots; i++)
+		atomic_init(&rw->slots[i].count, 0);
 	*rwp = rw;
 }
 
@@ -224,78 +437,68 @@ rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 {
 	enum rumprwlock type = enum_rumprwlock;
 
-	rumpuser_mutex_enter(rw->wait_mtx);
-
 	switch (type) {
 	case RUMPUSER_RW_WRITER:
-		rumpuser_mutex_enter(rw->access_mtx);
-		atomic_store(&rw->type, LOCK_RW_WRITER);
+		rumpuser_mutex_enter(rw->wmtx);
+		atomic_store(&rw->wstate, RW_WPENDING);
+		rw_drain(rw);
+		atomic_store(&rw->wstate, RW_WHELD);
 		break;
 	case RUMPUSER_RW_READER:
-		if (atomic_fetch_add(&rw->readers, 1) == 0) {
-			rumpuser_mutex_enter(rw->access_mtx);
-			atomic_store(&rw->type, LOCK_RW_READER);
-		}
+		if (rw_tryread(rw))
+			break;
+		/* no writer can be around while we hold wmtx */
+		rumpuser_mutex_enter(rw->wmtx);
+		atomic_fetch_add(rw_slot(rw), 1);
+		rumpuser_mutex_exit(rw->wmtx);
 		break;
 	}
-
-	rumpuser_mutex_exit(rw->wait_mtx);
 }
 
 int
 rumpuser_rw_tryenter(int enum_rumprwlock, struct rumpuser_rw *rw)
 {
 	enum rumprwlock type = enum_rumprwlock;
-	unsigned long readers;
-	int rc;
-
-	rc = rumpuser_mutex_tryenter(rw->wait_mtx);
-	if (rc != 0)
-		goto error2;
+	int rc = 0;
 
 	switch (type) {
 	case RUMPUSER_RW_WRITER:
-		rc = rumpuser_mutex_tryenter(rw->access_mtx);
-		if (rc != 0)
-			goto error1;
-		atomic_store(&rw->type, LOCK_RW_WRITER);
+		if ((rc = rumpuser_mutex_tryenter(rw->wmtx)) != 0)
+			break;
+		atomic_store(&rw->wstate, RW_WPENDING);
+		if (rw_readers(rw) != 0) {
+			atomic_store(&rw->wstate, 0);
+			rumpuser_mutex_exit(rw->wmtx);
+			rc = BMK_EBUSY;
+			break;
+		}
+		atomic_store(&rw->wstate, RW_WHELD);
 		break;
 	case RUMPUSER_RW_READER:
-		readers = atomic_load(&rw->readers);
-		do {
-			if (readers == 0) {
-				rc = rumpuser_mutex_tryenter(rw->access_mtx);
-				if (rc != 0)
-					goto error1;
-				atomic_store(&rw->readers, 1);
-				atomic_store(&rw->type, LOCK_RW_READER);
-			}
-		 } while (!atomic_compare_exchange_strong(&rw->readers,
-				&readers, readers + 1));
+		if (!rw_tryread(rw))
+			rc = BMK_EBUSY;
 		break;
 	}
 
-error1:
-	rumpuser_mutex_exit(rw->wait_mtx);
-error2:
 	return rc;
 }
 
 void
 rumpuser_rw_exit(struct rumpuser_rw *rw)
 {
-	if (atomic_load(&rw->type) == LOCK_RW_WRITER ||
-			atomic_fetch_sub(&rw->readers, 1) == 1) {
-		atomic_store(&rw->type, LOCK_RW_UNKNOWN);
-		rumpuser_mutex_exit(rw->access_mtx);
+	if (atomic_load(&rw->wstate) == RW_WHELD) {
+		atomic_store(&rw->wstate, 0);
+		rumpuser_mutex_exit(rw->wmtx);
+	} else {
+		rw_readexit(rw);
 	}
 }
 
 void
 rumpuser_rw_destroy(struct rumpuser_rw *rw)
 {
-	rumpuser_mutex_destroy(rw->wait_mtx);
-	rumpuser_mutex_destroy(rw->access_mtx);
+	rumpuser_mutex_destroy(rw->wmtx);
+	bmk_block_queue_destroy(&rw->wblock);
 	bmk_memfree(rw, BMK_MEMWHO_WIREDBMK);
 }
 
@@ -306,10 +509,11 @@ rumpuser_rw_held(int enum_rumprwlock, struct rumpuser_rw *rw, int *rvp)
 
 	switch (type) {
 	case RUMPUSER_RW_WRITER:
-		*rvp = atomic_load(&rw->type) == LOCK_RW_WRITER;
+		*rvp = atomic_load(&rw->wstate) == RW_WHELD;
 		break;
 	case RUMPUSER_RW_READER:
-		*rvp = atomic_load(&rw->type) == LOCK_RW_READER;
+		*rvp = atomic_load(&rw->wstate) != RW_WHELD
+		    && rw_readers(rw) > 0;
 		break;
 	}
 }
@@ -317,20 +521,29 @@ rumpuser_rw_held(int enum_rumprwlock, struct rumpuser_rw *rw, int *rvp)
 void
 rumpuser_rw_downgrade(struct rumpuser_rw *rw)
 {
-	atomic_store(&rw->type, LOCK_RW_READER);
-	if (atomic_fetch_add(&rw->readers, 1) != 0)
-		rumpuser_mutex_exit(rw->access_mtx);
+	atomic_fetch_add(rw_slot(rw), 1);
+	atomic_store(&rw->wstate, 0);
+	rumpuser_mutex_exit(rw->wmtx);
 }
 
+/*
+ * Succeeds only if the caller is the sole reader.  Readers arriving
+ * meanwhile can make it fail spuriously, which tryupgrade allows.
+ */
 int
 rumpuser_rw_tryupgrade(struct rumpuser_rw *rw)
 {
-	unsigned long readers = 1;
-	if (atomic_compare_exchange_strong(&rw->readers, &readers, 0)) {
-		atomic_store(&rw->type, LOCK_RW_WRITER);
-		return 0;
+	if (rumpuser_mutex_tryenter(rw->wmtx) != 0)
+		return BMK_EBUSY;
+	atomic_store(&rw->wstate, RW_WPENDING);
+	if (rw_readers(rw) != 1) {
+		atomic_store(&rw->wstate, 0);
+		rumpuser_mutex_exit(rw->wmtx);
+		return BMK_EBUSY;
 	}
-	return BMK_EBUSY;
+	atomic_fetch_sub(rw_slot(rw), 1);
+	atomic_store(&rw->wstate, RW_WHELD);
+	return 0;
 }
 
 struct rumpuser_cv {
@@ -361,12 +574,18 @@ cv_callback_timeout(struct bmk_thread *prev, struct bmk_block_data *_bcv)
 }
 
 static void
-cv_sched_enter(int nlocks, struct rumpuser_mtx *mtx)
+cv_sched_enter(int nlocks, struct rumpuser_mtx *mtx, bool morphed)
 {
 	const int mask = RUMPUSER_MTX_KMUTEX | RUMPUSER_MTX_SPIN;
 
+	/* The mutex was handed to us by rumpuser_mutex_exit(). */
+	if (morphed) {
+		mtx_setowner(mtx, rumpuser_curlwp());
+		BMK_LOCKSTAT_ACQUIRED(&mtx->lockstat, mtx, BMK_LOCKSTAT_MUTEX,
+		    0, BMK_LOCKSTAT_HERE());
+		rumpkern_sched(nlocks, mtx);
 	/* For a spin mutex, reacquire the CPU context first. */
-	if ((mtx->flags & mask) == mask) {
+	} else if ((mtx->flags & mask) == mask) {
 		rumpkern_sched(nlocks, mtx);
 		rumpuser_mutex_enter_nowrap(mtx);
 	} else {
@@ -375,6 +594,38 @@ cv_sched_enter(int nlocks, struct rumpuser_mtx *mtx)
 	}
 }
 
+/*
+ * Wait morphing: waiters on a CV whose mutex the waker holds are not
+ * woken, only to contend for that mutex, but are moved straight onto
+ * the mutex's sleep queue.  rumpuser_mutex_exit() then hands the
+ * mutex to them one at a time.  Spin mutexes have no sleep queue.
+ */
+static inline bool
+cv_morphable(struct rumpuser_mtx *mtx)
+{
+	return (mtx->flags & RUMPUSER_MTX_SPIN) == 0;
+}
+
+static void
+cv_wake(struct waiter *w)
+{
+	struct bmk_thread *thread = w->thread;
+	struct rumpuser_mtx *mtx = w->mtx;
+
+	w->thread = NULL;
+	if (mtx == NULL || mtx->owner == NULL
+	    || mtx->owner != rumpuser_curlwp()) {
+		w->wake(thread);
+		return;
+	}
+	/* already timed out, it will come for the mutex by itself */
+	if (w->wake == bmk_sched_wake_timeq && !bmk_sched_cancel_timeq(thread))
+		return;
+	w->morphed = true;
+	atomic_fetch_add(&mtx->counter, 1);
+	bmk_block_queue_insert(&mtx->block, thread);
+}
+
 void
 rumpuser_cv_init(struct rumpuser_cv **cvp)
 {
@@ -413,13 +664,15 @@ rumpuser_cv_wait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx)
 	bcv.mtx = mtx;
 	w.thread = bmk_current;
 	w.wake = bmk_sched_wake;
+	w.mtx = cv_morphable(mtx) ? mtx : NULL;
+	w.morphed = false;
 
 	TAILQ_INSERT_TAIL(&cv->waiters, &w, entries);
 
 	bmk_sched_blockprepare();
 	bmk_sched_block(&bcv.header);
 
-	cv_sched_enter(nlocks, mtx);
+	cv_sched_enter(nlocks, mtx, w.morphed);
 }
 
 void
@@ -435,6 +688,8 @@ rumpuser_cv_wait_nowrap(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx)
 	bcv.mtx = mtx;
 	w.thread = bmk_current;
 	w.wake = bmk_sched_wake;
+	w.mtx = NULL;
+	w.morphed = false;
 
 	TAILQ_INSERT_TAIL(&cv->waiters, &w, entries);
 
@@ -462,6 +717,8 @@ rumpuser_cv_timedwait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx,
 	bcv.mtx = mtx;
 	w.thread = bmk_current;
 	w.wake = bmk_sched_wake_timeq;
+	w.mtx = cv_morphable(mtx) ? mtx : NULL;
+	w.morphed = false;
 	time = bmk_platform_cpu_clock_monotonic() +
 			sec * UINT64_C(1000000000) + nsec;
 
@@ -470,7 +727,7 @@ rumpuser_cv_timedwait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx,
 	bmk_sched_blockprepare_timeout(time, bmk_sched_wake);
 	result = bmk_sched_block(&bcv.header);
 
-	cv_sched_enter(nlocks, mtx);
+	cv_sched_enter(nlocks, mtx, w.morphed);
 	if (w.thread)
 		TAILQ_REMOVE(&cv->waiters, &w, entries);
 
@@ -480,7 +737,6 @@ rumpuser_cv_timedwait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx,
 void
 rumpuser_cv_signal(struct rumpuser_cv *cv)
 {
-	struct bmk_thread *thread;
 	struct waiter *w;
 
 #ifdef RUMPUSER_SYNCH_DEBUG
@@ -488,16 +744,13 @@ rumpuser_cv_signal(struct rumpuser_cv *cv)
 #endif
 	if ((w = TAILQ_FIRST(&cv->waiters)) != NULL) {
 		TAILQ_REMOVE(&cv->waiters, w, entries);
-		thread = w->thread;
-		w->thread = NULL;
-		w->wake(thread);
+		cv_wake(w);
 	}
 }
 
 void
 rumpuser_cv_broadcast(struct rumpuser_cv *cv)
 {
-	struct bmk_thread *thread;
 	struct waiter *w;
 
 #ifdef RUMPUSER_SYNCH_DEBUG
@@ -505,9 +758,7 @@ rumpuser_cv_broadcast(struct rumpuser_cv *cv)
 #endif
 	while ((w = TAILQ_FIRST(&cv->waiters)) != NULL) {
 		TAILQ_REMOVE(&cv->waiters, w, entries);
-		thread = w->thread;
-		w->thread = NULL;
-		w->wake(thread);
+		cv_wake(w);
 	}
 }
 
@@ -45,6 +45,7 @@ static const struct rump_onesyscall mysys[] = {
 	ENTRY(munmap)
 	ENTRY(__msync13)
 	ENTRY(mincore)
+	ENTRY(madvise)
 	ENTRY(mprotect)
 	ENTRY(mlock)
 	ENTRY(mlockall)
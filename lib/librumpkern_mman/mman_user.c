@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <bmk-core/platform.h>
+
+#include "mman_user.h"
+
+void *
+rumpcomp_mman_reserve(unsigned long len)
+{
+
+	return bmk_platform_vmem_reserve(len);
+}
+
+int
+rumpcomp_mman_release(void *addr, unsigned long len)
+{
+
+	return bmk_platform_vmem_release(addr, len);
+}
+
+void
+rumpcomp_mman_discard(void *addr, unsigned long len)
+{
+
+	bmk_platform_vmem_discard(addr, len);
+}
+
+int
+rumpcomp_mman_resident(void *addr)
+{
+
+	return bmk_platform_vmem_resident(addr);
+}
+
+int
+rumpcomp_mman_guard(void *addr, unsigned long len, int guard)
+{
+
+	return bmk_platform_guard(addr, len, guard);
+}
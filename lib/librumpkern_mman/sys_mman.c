@@ -26,7 +26,9 @@
 /*
  * Memory management syscall implementations.  These are mostly ~nops,
  * apart from mmap, which we sort of attempt to emulate since many
- * programs reserve memory using mmap instead of malloc.
+ * programs reserve memory using mmap instead of malloc.  Anonymous
+ * mappings are reserved from the platform's demand-paged memory when
+ * it has some, so that they cost nothing until touched.
  */
 
 #include <sys/cdefs.h>
@@ -46,6 +48,8 @@
 
 #include "rump_private.h"
 
+#include "mman_user.h"
+
 #ifdef RUMPRUN_MMAP_DEBUG
 #define MMAP_PRINTF(x) printf x
 #else
@@ -58,6 +62,7 @@ struct mmapchunk {
 	void *mm_start;
 	size_t mm_size;
 	size_t mm_pgsleft;
+	bool mm_lazy;
 
 	LIST_ENTRY(mmapchunk) mm_chunks;
 };
@@ -67,21 +72,33 @@ struct mmapchunk {
  */
 static LIST_HEAD(, mmapchunk) mmc_list = LIST_HEAD_INITIALIZER(&mmc_list);
 
+/*
+ * If *lazyp is set, try to reserve demand-paged memory.  On return
+ * *lazyp tells if that is what was allocated.
+ */
 static void *
-mmapmem_alloc(size_t roundedlen)
+mmapmem_alloc(size_t roundedlen, bool *lazyp)
 {
 	struct mmapchunk *mc;
-	void *v;
+	bool lazy = *lazyp;
+	void *v = NULL;
 
 	mc = kmem_alloc(sizeof(*mc), KM_SLEEP);
 	if (mc == NULL)
 		return NULL;
 
-	v = rump_hypermalloc(roundedlen, PAGE_SIZE, true, "mmapmem");
+	if (lazy)
+		v = rumpcomp_mman_reserve(roundedlen);
+	if (v == NULL) {
+		v = rump_hypermalloc(roundedlen, PAGE_SIZE, true, "mmapmem");
+		lazy = false;
+	}
+	*lazyp = lazy;
 
 	mc->mm_start = v;
 	mc->mm_size = roundedlen;
 	mc->mm_pgsleft = roundedlen / PAGE_SIZE;
+	mc->mm_lazy = lazy;
 
 	bmk_simple_lock_enter(&mmapmem_lock);
 	LIST_INSERT_HEAD(&mmc_list, mc, mm_chunks);
@@ -90,21 +107,36 @@ mmapmem_alloc(size_t roundedlen)
 	return v;
 }
 
-static int
-mmapmem_free(void *addr, size_t roundedlen)
+/* Called with the lock held. */
+static struct mmapchunk *
+mmapmem_lookup(void *addr, size_t roundedlen)
 {
 	struct mmapchunk *mc;
-	size_t npgs;
-	int err = 0;
 
-	bmk_simple_lock_enter(&mmapmem_lock);
 	LIST_FOREACH(mc, &mmc_list, mm_chunks) {
 		if (mc->mm_start <= addr &&
 		    ((uint8_t *)mc->mm_start + mc->mm_size
 		      >= (uint8_t *)addr + roundedlen))
 			break;
 	}
-	if (!mc) {
+	return mc;
+}
+
+static int
+mmapmem_free(void *addr, size_t roundedlen)
+{
+	struct mmapchunk *mc;
+	size_t npgs;
+	int err = 0;
+
+	bmk_simple_lock_enter(&mmapmem_lock);
+	if ((mc = mmapmem_lookup(addr, roundedlen)) == NULL) {
+		err = EINVAL;
+		goto done;
+	}
+	/* lazy memory is given back right away, and only once */
+	if (mc->mm_lazy && rumpcomp_mman_release(addr, roundedlen) != 0) {
+		mc = NULL;
 		err = EINVAL;
 		goto done;
 	}
@@ -123,7 +155,8 @@ mmapmem_free(void *addr, size_t roundedlen)
 done:
 	bmk_simple_lock_exit(&mmapmem_lock);
 	if (mc) {
-		kmem_free(mc->mm_start, mc->mm_size);
+		if (!mc->mm_lazy)
+			kmem_free(mc->mm_start, mc->mm_size);
 		kmem_free(mc, sizeof(*mc));
 	}
 	return err;
@@ -141,6 +174,7 @@ sys_mmap(struct lwp *l, const struct sys_mmap_args *uap, register_t *retval)
 	register_t cnt;
 	void *v;
 	size_t roundedlen;
+	bool lazy;
 	int error = 0;
 
 	MMAP_PRINTF(("-> mmap: %p %zu, 0x%x, 0x%x, %d, %" PRId64 "\n",
@@ -163,14 +197,17 @@ sys_mmap(struct lwp *l, const struct sys_mmap_args *uap, register_t *retval)
 
 	/* allocate full whatever-we-lie-to-be-pages */
 	roundedlen = roundup2(len, PAGE_SIZE);
-	if ((v = mmapmem_alloc(roundedlen)) == NULL) {
+	lazy = (flags & MAP_ANON) != 0;
+	if ((v = mmapmem_alloc(roundedlen, &lazy)) == NULL) {
 		return ENOMEM;
 	}
 
 	*retval = (register_t)v;
 
 	if (flags & MAP_ANON) {
-		memset(v, 0, roundedlen);
+		/* lazy memory reads as zero until touched */
+		if (!lazy)
+			memset(v, 0, roundedlen);
 		return 0;
 	}
 
@@ -254,33 +291,103 @@ int
 sys_mincore(struct lwp *l, const struct sys_mincore_args *uap,
 	register_t *retval)
 {
+	uint8_t *addr = SCARG(uap, addr);
 	size_t len = SCARG(uap, len);
 	char *vec = SCARG(uap, vec);
+	struct mmapchunk *mc;
+	size_t i, npgs;
+
+	if (((uintptr_t)addr & (PAGE_SIZE-1)) != 0)
+		return EINVAL;
+	npgs = (len + PAGE_SIZE - 1) / PAGE_SIZE;
 
 	/*
 	 * Questionable if we should allocate vec + copyout().
 	 * Guess that's the problem of the person why copypastes
 	 * this code into the wrong place.
+	 *
+	 * Only lazy memory can be non-resident.
 	 */
-	memset(vec, 0x01, (len + PAGE_SIZE - 1) / PAGE_SIZE);
+	bmk_simple_lock_enter(&mmapmem_lock);
+	mc = mmapmem_lookup(addr, npgs * PAGE_SIZE);
+	if (mc && mc->mm_lazy) {
+		for (i = 0; i < npgs; i++)
+			vec[i] = rumpcomp_mman_resident(addr + i*PAGE_SIZE);
+	} else {
+		memset(vec, 0x01, npgs);
+	}
+	bmk_simple_lock_exit(&mmapmem_lock);
+	return 0;
+}
+
+/*
+ * MADV_DONTNEED and MADV_FREE give lazy memory back; it reads as
+ * zero when touched again.  Wired memory stays as it is.
+ */
+int
+sys_madvise(struct lwp *l, const struct sys_madvise_args *uap,
+	register_t *retval)
+{
+	void *addr = SCARG(uap, addr);
+	size_t len = SCARG(uap, len);
+	int advice = SCARG(uap, behav);
+	struct mmapchunk *mc;
+
+	if (((uintptr_t)addr & (PAGE_SIZE-1)) != 0)
+		return EINVAL;
+	if (advice != MADV_DONTNEED && advice != MADV_FREE)
+		return 0;
+
+	len = roundup2(len, PAGE_SIZE);
+	bmk_simple_lock_enter(&mmapmem_lock);
+	mc = mmapmem_lookup(addr, len);
+	if (mc && mc->mm_lazy)
+		rumpcomp_mman_discard(addr, len);
+	bmk_simple_lock_exit(&mmapmem_lock);
 	return 0;
 }
 
+/*
+ * PROT_NONE on lazy memory turns the pages into guard pages, which
+ * is what thread libraries use to catch stack overflows.  Other
+ * protections are not enforced.
+ */
+int
+sys_mprotect(struct lwp *l, const struct sys_mprotect_args *uap,
+	register_t *retval)
+{
+	void *addr = SCARG(uap, addr);
+	size_t len = SCARG(uap, len);
+	int prot = SCARG(uap, prot);
+	struct mmapchunk *mc;
+	int error = 0;
+
+	if (((uintptr_t)addr & (PAGE_SIZE-1)) != 0)
+		return EINVAL;
+
+	len = roundup2(len, PAGE_SIZE);
+	bmk_simple_lock_enter(&mmapmem_lock);
+	mc = mmapmem_lookup(addr, len);
+	if (mc && mc->mm_lazy
+	    && rumpcomp_mman_guard(addr, len, prot == PROT_NONE) != 0)
+		error = ENOMEM;
+	bmk_simple_lock_exit(&mmapmem_lock);
+	return error;
+}
+
 /*
  * Rest are stubs.
  */
 
 int
-sys_madvise(struct lwp *l, const struct sys_madvise_args *uap,
+sys_mlock(struct lwp *l, const struct sys_mlock_args *uap,
 	register_t *retval)
 {
 
 	return 0;
 }
 
-__strong_alias(sys_mprotect,sys_madvise);
-__strong_alias(sys_minherit,sys_madvise);
-__strong_alias(sys_mlock,sys_madvise);
-__strong_alias(sys_mlockall,sys_madvise);
-__strong_alias(sys_munlock,sys_madvise);
-__strong_alias(sys_munlockall,sys_madvise);
+__strong_alias(sys_minherit,sys_mlock);
+__strong_alias(sys_mlockall,sys_mlock);
+__strong_alias(sys_munlock,sys_mlock);
+__strong_alias(sys_munlockall,sys_mlock);
@@ -35,6 +35,7 @@
 #include <sys/tls.h>
 
 #include <assert.h>
+#include <stddef.h>
 #include <errno.h>
 #include <lwp.h>
 #include <sched.h>
@@ -46,6 +47,8 @@
 #include <rump/rump.h>
 
 #include <bmk-core/core.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/rcu.h>
 #include <bmk-core/sched.h>
 #include <bmk-core/simple_lock.h>
 
@@ -56,11 +59,16 @@
 #define RL_MASK_UNPARK	0x1
 #define RL_MASK_PARK	0x2
 
+/* bounds for the adaptive spin in _lwp_park() */
+#define RL_SPIN_MIN	16
+#define RL_SPIN_MAX	4096
+
 struct rumprun_lwp {
 	struct bmk_block_data rl_header;
 	unsigned long rl_value;
 	void (*rl_wake) (struct bmk_thread *);
 	struct bmk_thread *rl_thread;
+	unsigned int rl_spin;
 	int rl_lwpid;
 	char rl_name[MAXCOMLEN+1];
 	void (*rl_start)(void *);
@@ -69,14 +77,32 @@ struct rumprun_lwp {
 	struct lwpctl rl_lwpctl;
 
 	TAILQ_ENTRY(rumprun_lwp) rl_entries;
-};
-static TAILQ_HEAD(, rumprun_lwp) all_lwp = TAILQ_HEAD_INITIALIZER(all_lwp);
+	struct bmk_rcu_head rl_rcu;
+} __attribute__ ((aligned(BMK_PCPU_L1_SIZE)));
 static __thread struct rumprun_lwp *me;
 
-static bmk_simple_lock_t lwp_lock = BMK_SIMPLE_LOCK_INITIALIZER;
+/*
+ * lwps are allocated in chunks which are never freed, and the lwpid
+ * is the index into the chunk table, so lwpid2rl() needs no lock.
+ * An exited lwp goes back on the free list, lwpid and all, once its
+ * thread is surely off the CPU.  A stale lwpid may therefore unpark
+ * an unrelated lwp, but _lwp_park() callers cope with spurious
+ * wakeups anyway.  The free list is FIFO so that an lwpid is reused
+ * as late as possible.  lwp_lock covers only the free list and chunk
+ * table growth.
+ */
+#define LWP_CHUNK	256
+#define LWP_NCHUNKS	(BMK_MAX_THREADS / LWP_CHUNK)
+static struct rumprun_lwp *lwp_chunks[LWP_NCHUNKS];
+static unsigned long lwp_nchunks;
+static TAILQ_HEAD(, rumprun_lwp) free_lwp = TAILQ_HEAD_INITIALIZER(free_lwp);
 
+static bmk_simple_lock_t lwp_lock =
+    BMK_SIMPLE_LOCK_INITIALIZER_FLAGS(BMK_SIMPLE_LOCK_PV);
+
+/* lwpids of created lwps follow the main thread's */
 #define FIRST_LWPID 1
-static int curlwpid = FIRST_LWPID;
+#define LWPID_BASE (FIRST_LWPID + 1)
 
 static struct rumprun_lwp mainthread = {
 	.rl_lwpid = FIRST_LWPID,
@@ -84,6 +110,54 @@ static struct rumprun_lwp mainthread = {
 
 static void rumprun_makelwp_tramp(void *);
 
+static struct rumprun_lwp *
+lwp_alloc(void)
+{
+	struct rumprun_lwp *rl, *chunk;
+	unsigned long i, n;
+
+	bmk_simple_lock_enter(&lwp_lock);
+	rl = TAILQ_FIRST(&free_lwp);
+	if (rl == NULL && lwp_nchunks < LWP_NCHUNKS) {
+		n = lwp_nchunks;
+		if (posix_memalign((void **)&chunk, BMK_PCPU_L1_SIZE,
+		    LWP_CHUNK * sizeof(*chunk)) == 0) {
+			memset(chunk, 0, LWP_CHUNK * sizeof(*chunk));
+			for (i = 0; i < LWP_CHUNK; i++) {
+				chunk[i].rl_lwpid = LWPID_BASE
+				    + n * LWP_CHUNK + i;
+				TAILQ_INSERT_TAIL(&free_lwp, &chunk[i], rl_entries);
+			}
+			__atomic_store_n(&lwp_chunks[n], chunk,
+			    __ATOMIC_RELEASE);
+			lwp_nchunks = n + 1;
+			rl = TAILQ_FIRST(&free_lwp);
+		}
+	}
+	if (rl != NULL)
+		TAILQ_REMOVE(&free_lwp, rl, rl_entries);
+	bmk_simple_lock_exit(&lwp_lock);
+
+	return rl;
+}
+
+static void
+lwp_free(struct rumprun_lwp *rl)
+{
+
+	bmk_simple_lock_enter(&lwp_lock);
+	TAILQ_INSERT_TAIL(&free_lwp, rl, rl_entries);
+	bmk_simple_lock_exit(&lwp_lock);
+}
+
+static void
+lwp_free_rcu(struct bmk_rcu_head *rh)
+{
+
+	lwp_free((struct rumprun_lwp *)
+	    ((char *)rh - offsetof(struct rumprun_lwp, rl_rcu)));
+}
+
 static ptrdiff_t meoff;
 static void
 assignme(void *tcb, struct rumprun_lwp *value)
@@ -121,38 +195,44 @@ rumprun_makelwp(void (*start)(void *), void *arg, void *private,
 	void *stack_base, size_t stack_size, unsigned long flag, lwpid_t *lid)
 {
 	struct rumprun_lwp *rl;
+	struct bmk_thread *thread;
 	struct lwp *curlwp, *newlwp;
 
-	rl = calloc(1, sizeof(*rl));
+	/* stacks must not fault, see bmk_platform_vmem_commit() */
+	if (bmk_platform_vmem_commit(stack_base, stack_size) != 0)
+		return ENOMEM;
+
+	rl = lwp_alloc();
 	if (rl == NULL)
-		return errno;
+		return EAGAIN;
 	assignme(private, rl);
 
 	curlwp = rump_pub_lwproc_curlwp();
 	if ((errno = rump_pub_lwproc_newlwp(getpid())) != 0) {
-		free(rl);
+		lwp_free(rl);
 		return errno;
 	}
 	newlwp = rump_pub_lwproc_curlwp();
 	rl->rl_header.callback = _lwp_park_callback;
 	rl->rl_value = RL_MASK_PARK;
+	rl->rl_spin = RL_SPIN_MIN;
+	rl->rl_name[0] = '\0';
 	rl->rl_start = start;
 	rl->rl_arg = arg;
-	rl->rl_lwpid = ++curlwpid;
-	rl->rl_thread = bmk_sched_create_withtls("lwp", rl, 0, -1,
+	memset(&rl->rl_lwpctl, 0, sizeof(rl->rl_lwpctl));
+	thread = bmk_sched_create_withtls("lwp", rl, 0, -1,
 	    rumprun_makelwp_tramp, newlwp, stack_base, stack_size, private);
-	if (rl->rl_thread == NULL) {
-		free(rl);
+	if (thread == NULL) {
+		lwp_free(rl);
 		rump_pub_lwproc_releaselwp();
 		rump_pub_lwproc_switch(curlwp);
 		return EBUSY; /* ??? */
 	}
 	rump_pub_lwproc_switch(curlwp);
 
+	/* publish to lwpid2rl() */
+	__atomic_store_n(&rl->rl_thread, thread, __ATOMIC_RELEASE);
 	*lid = rl->rl_lwpid;
-	bmk_simple_lock_enter(&lwp_lock);
-	TAILQ_INSERT_TAIL(&all_lwp, rl, rl_entries);
-	bmk_simple_lock_exit(&lwp_lock);
 
 	return 0;
 }
@@ -168,19 +248,23 @@ rumprun_makelwp_tramp(void *arg)
 static struct rumprun_lwp *
 lwpid2rl(lwpid_t lid)
 {
-	struct rumprun_lwp *rl;
+	struct rumprun_lwp *chunk, *rl;
+	unsigned long idx;
 
-	if (lid == 0)
+	if (lid == 0 || lid == FIRST_LWPID)
 		return &mainthread;
-	bmk_simple_lock_enter(&lwp_lock);
-	TAILQ_FOREACH(rl, &all_lwp, rl_entries) {
-		if (rl->rl_lwpid == lid) {
-			bmk_simple_lock_exit(&lwp_lock);
-			return rl;
-		}
-	}
-	bmk_simple_lock_exit(&lwp_lock);
-	return NULL;
+	if (lid < LWPID_BASE)
+		return NULL;
+	idx = lid - LWPID_BASE;
+	if (idx / LWP_CHUNK >= LWP_NCHUNKS)
+		return NULL;
+	chunk = __atomic_load_n(&lwp_chunks[idx / LWP_CHUNK], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return NULL;
+	rl = &chunk[idx % LWP_CHUNK];
+	if (__atomic_load_n(&rl->rl_thread, __ATOMIC_ACQUIRE) == NULL)
+		return NULL;
+	return rl;
 }
 
 int
@@ -265,26 +349,68 @@ rumprun_lwp_init(void)
 	mainthread.rl_thread = bmk_sched_init_mainlwp(&mainthread);
 	mainthread.rl_header.callback = _lwp_park_callback;
 	mainthread.rl_value = RL_MASK_PARK;
+	mainthread.rl_spin = RL_SPIN_MIN;
+}
 
-	TAILQ_INSERT_TAIL(&all_lwp, me, rl_entries);
+/*
+ * Poll for an unpark for a while before blocking, which saves the
+ * block/wake round trip when the unparker is about to run on another
+ * CPU, as for a briefly held pthread mutex.  The budget adapts per
+ * lwp: it doubles whenever polling caught the unpark and halves
+ * whenever it did not.
+ */
+static int
+lwp_park_spin(struct rumprun_lwp *rl)
+{
+	unsigned int i, spin = rl->rl_spin;
+
+	if (bmk_numcpus == 1)
+		return 0;
+
+	for (i = 0; i < spin; i++) {
+		if (__atomic_load_n(&rl->rl_value, __ATOMIC_RELAXED)
+		    == RL_MASK_UNPARK) {
+			__atomic_exchange_n(&rl->rl_value, RL_MASK_PARK,
+			    __ATOMIC_ACQ_REL);
+			if (spin < RL_SPIN_MAX)
+				rl->rl_spin = spin * 2;
+			return 1;
+		}
+		bmk_cpu_relax();
+	}
+	if (spin > RL_SPIN_MIN)
+		rl->rl_spin = spin / 2;
+	return 0;
 }
 
 int
 _lwp_park(clockid_t clock_id, int flags, struct timespec *ts,
 	lwpid_t unpark, const void *hint, const void *unparkhint)
 {
+	struct rumprun_lwp *rl = NULL;
 	int rv;
 
-	if (unpark)
-		_lwp_unpark(unpark, unparkhint);
+	/* rl stays set only if it was parked and we have to wake it */
+	if (unpark && (rl = lwpid2rl(unpark)) != NULL &&
+	    __atomic_exchange_n(&rl->rl_value, RL_MASK_UNPARK,
+				__ATOMIC_ACQ_REL) != 0)
+		rl = NULL;
 
 	/* Unparked: clean the RL_MASK_UNPARK bit. */
 	if (__atomic_exchange_n(&me->rl_value, RL_MASK_PARK, __ATOMIC_ACQ_REL)
 			== RL_MASK_UNPARK) {
+		if (rl != NULL)
+			rl->rl_wake(rl->rl_thread);
 		rv = EALREADY;
 		goto done;
 	}
 
+	/* Nobody to hand the CPU to; it is ours to spin on. */
+	if (rl == NULL && lwp_park_spin(me)) {
+		rv = 0;
+		goto done;
+	}
+
 	if (ts) {
 		bmk_time_t nsecs = ts->tv_sec*1000*1000*1000 + ts->tv_nsec;
 
@@ -300,7 +426,18 @@ _lwp_park(clockid_t clock_id, int flags, struct timespec *ts,
 		me->rl_wake = bmk_sched_wake;
 	}
 
-	rv = bmk_sched_block(&me->rl_header);
+	/*
+	 * Switch straight to the lwp we unparked, typically a waiter
+	 * on the mutex our caller just released, instead of making it
+	 * wait for a CPU.  A timed sleeper must leave timeq first.
+	 */
+	if (rl != NULL && rl->rl_wake == bmk_sched_wake) {
+		rv = bmk_sched_wake_and_switch(rl->rl_thread, &me->rl_header);
+	} else {
+		if (rl != NULL)
+			rl->rl_wake(rl->rl_thread);
+		rv = bmk_sched_block(&me->rl_header);
+	}
 
 	/* Clean the RL_MASK_UNPARK bit. */
 	__atomic_store_n(&me->rl_value, RL_MASK_PARK, __ATOMIC_SEQ_CST);
@@ -322,9 +459,15 @@ _lwp_exit(void)
 
 	me->rl_lwpctl.lc_curcpu = LWPCTL_CPU_EXITED;
 	rump_pub_lwproc_releaselwp();
-	bmk_simple_lock_enter(&lwp_lock);
-	TAILQ_REMOVE(&all_lwp, me, rl_entries);
-	bmk_simple_lock_exit(&lwp_lock);
+
+	/*
+	 * Recycle only after a grace period: until then the scheduler
+	 * hook may still touch our lwpctl on the way out.
+	 */
+	if (me != &mainthread) {
+		__atomic_store_n(&me->rl_thread, NULL, __ATOMIC_RELEASE);
+		bmk_rcu_call(&me->rl_rcu, lwp_free_rcu);
+	}
 
 	/* could just assign it here, but for symmetry! */
 	assignme(bmk_sched_gettcb(), NULL);
@@ -43,6 +43,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,6 +56,10 @@
 #include <rumprun-base/parseargs.h>
 
 #include <bmk-core/jsmn.h>
+#include <bmk-core/lockstat.h>
+#include <bmk-core/memalloc.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/sched.h>
 
 /* helper macros */
 #define T_SIZE(t) ((t)->end - (t)->start)
@@ -94,6 +99,7 @@ token2cstr(jsmntok_t *t, char *data)
 }
 
 struct rumprun_execs rumprun_execs = TAILQ_HEAD_INITIALIZER(rumprun_execs);
+int rumprun_memstats;
 
 static void
 makeargv(char *argvstr)
@@ -270,6 +276,117 @@ handle_hostname(jsmntok_t *t, int left, char *data)
 	return 1;
 }
 
+/*
+ * "schedtrace": "1" turns on the scheduler trace and run/wait time
+ * accounting.  The trace is dumped when the guest shuts down.
+ */
+static int
+handle_schedtrace(jsmntok_t *t, int left, char *data)
+{
+
+	T_CHECKTYPE(t, data, JSMN_STRING, __func__);
+
+	bmk_sched_trace(strcmp(token2cstr(t, data), "0") != 0);
+
+	return 1;
+}
+
+/*
+ * "maxthreads": "<n>" changes the limit on the number of threads.  It
+ * can be raised only as far as the scheduler made room for at boot.
+ */
+static int
+handle_maxthreads(jsmntok_t *t, int left, char *data)
+{
+	const char *v;
+	char *ep;
+	unsigned long n, rv;
+
+	T_CHECKTYPE(t, data, JSMN_STRING, __func__);
+
+	v = token2cstr(t, data);
+	n = strtoul(v, &ep, 10);
+	if (*v == '\0' || *ep != '\0')
+		errx(1, "maxthreads: \"%s\" is not a number", v);
+	if ((rv = bmk_sched_setmaxthreads(n)) != n)
+		warnx("maxthreads: limit set to %lu", rv);
+
+	return 1;
+}
+
+/*
+ * "balloon": "<MB>" is how much free memory to keep.  The rest goes
+ * back to the host when the platform supports it.
+ */
+static int
+handle_balloon(jsmntok_t *t, int left, char *data)
+{
+	const char *mb;
+	char *ep;
+	unsigned long v;
+
+	T_CHECKTYPE(t, data, JSMN_STRING, __func__);
+
+	mb = token2cstr(t, data);
+	v = strtoul(mb, &ep, 10);
+	if (*mb == '\0' || *ep != '\0')
+		errx(1, "balloon: \"%s\" is not a number", mb);
+	bmk_pgalloc_balloon_setfree(v << 10);
+
+	return 1;
+}
+
+/*
+ * "lockstat": "1" turns on lock profiling, if compiled in.  The
+ * statistics are dumped when the guest shuts down.
+ */
+static int
+handle_lockstat(jsmntok_t *t, int left, char *data)
+{
+
+	T_CHECKTYPE(t, data, JSMN_STRING, __func__);
+
+	bmk_lockstat_enable(strcmp(token2cstr(t, data), "0") != 0);
+
+	return 1;
+}
+
+/*
+ * "memstats": "1" prints memory allocator statistics when the guest
+ * shuts down.  "memsample": "<n>" also records the call site of every
+ * n'th allocation on each CPU, shown with those statistics.
+ */
+static int
+handle_memstats(jsmntok_t *t, int left, char *data)
+{
+
+	T_CHECKTYPE(t, data, JSMN_STRING, __func__);
+
+	rumprun_memstats = strcmp(token2cstr(t, data), "0") != 0;
+
+	return 1;
+}
+
+static int
+handle_memsample(jsmntok_t *t, int left, char *data)
+{
+	const char *v;
+	char *ep;
+	unsigned long n;
+
+	T_CHECKTYPE(t, data, JSMN_STRING, __func__);
+
+	v = token2cstr(t, data);
+	n = strtoul(v, &ep, 10);
+	if (*v == '\0' || *ep != '\0' || n > UINT_MAX)
+		errx(1, "memsample: \"%s\" is not a valid interval", v);
+	bmk_memstat_setsampling(n);
+	if (n != 0)
+		rumprun_memstats = 1;
+
+	return 1;
+}
+
 static void
 config_ipv4(const char *ifname, const char *method,
 	const char *addr, const char *mask, const char *gw)
@@ -660,6 +777,12 @@ struct {
 	{ "hostname", handle_hostname },
 	{ "blk", handle_blk },
 	{ "net", handle_net },
+	{ "schedtrace", handle_schedtrace },
+	{ "maxthreads", handle_maxthreads },
+	{ "lockstat", handle_lockstat },
+	{ "memstats", handle_memstats },
+	{ "memsample", handle_memsample },
+	{ "balloon", handle_balloon },
 };
 
 /* don't believe we can have a >64k config */
@@ -23,7 +23,10 @@
  * SUCH DAMAGE.
  */
 
+#include <bmk-core/lockstat.h>
 #include <bmk-core/mainthread.h>
+#include <bmk-core/memalloc.h>
+#include <bmk-core/pgalloc.h>
 #include <bmk-core/printf.h>
 #include <bmk-core/sched.h>
 
@@ -79,5 +82,13 @@ bmk_mainthread(void *cmdline)
 	while ((cookie = rumprun_get_finished()))
 		rumprun_wait(cookie);
 
+	/* print nothing unless "schedtrace" or "lockstat" was configured */
+	bmk_sched_dumptrace();
+	bmk_lockstat_dump();
+	if (rumprun_memstats) {
+		bmk_memalloc_printstats();
+		bmk_szalloc_printstats();
+		bmk_pgalloc_dumpstats();
+	}
 	rumprun_reboot();
 }
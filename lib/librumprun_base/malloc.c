@@ -30,13 +30,35 @@
 #include <bmk-core/errno.h>
 #include <bmk-core/memalloc.h>
 
+/*
+ * User memory comes from the size-class allocator by default.
+ * Define RUMPRUN_MALLOC_BUCKETS to use the power-of-two bucket
+ * allocator shared with the bmk and rump kernel layers instead.
+ */
+#ifdef RUMPRUN_MALLOC_BUCKETS
+#define user_alloc(n, a)	bmk_memalloc(n, a, BMK_MEMWHO_USER)
+#define user_calloc(n, s)	bmk_memcalloc(n, s, BMK_MEMWHO_USER)
+#define user_realloc(p, n)	bmk_memrealloc_user(p, n)
+#define user_free(p)		bmk_memfree(p, BMK_MEMWHO_USER)
+#else
+#define user_alloc(n, a)	bmk_szalloc(n, a)
+#define user_calloc(n, s)	bmk_szcalloc(n, s)
+#define user_realloc(p, n)	bmk_szrealloc(p, n)
+#define user_free(p)		bmk_szfree(p)
+#endif
+
+/* attribute sampled allocations to the application's call site */
+#define user_sample(n) \
+    bmk_memstat_sample(BMK_MEMWHO_USER, n, __builtin_return_address(0))
+
 int
 posix_memalign(void **rv, size_t align, size_t nbytes)
 {
 	void *v;
 	int error = BMK_ENOMEM;
 
-	if ((v = bmk_memalloc(nbytes, align, BMK_MEMWHO_USER)) != NULL) {
+	user_sample(nbytes);
+	if ((v = user_alloc(nbytes, align)) != NULL) {
 		*rv = v;
 		error = 0;
 	}
@@ -48,26 +70,29 @@ void *
 malloc(size_t size)
 {
 
-	return bmk_memalloc(size, 8, BMK_MEMWHO_USER);
+	user_sample(size);
+	return user_alloc(size, 8);
 }
 
 void *
 calloc(size_t n, size_t size)
 {
 
-	return bmk_memcalloc(n, size, BMK_MEMWHO_USER);
+	user_sample(n * size);
+	return user_calloc(n, size);
 }
 
 void *
 realloc(void *cp, size_t nbytes)
 {
 
-	return bmk_memrealloc_user(cp, nbytes);
+	user_sample(nbytes);
+	return user_realloc(cp, nbytes);
 }
 
 void
 free(void *cp)
 {
 
-	bmk_memfree(cp, BMK_MEMWHO_USER);
+	user_free(cp);
 }
@@ -74,9 +74,18 @@ struct tss {
 	unsigned long	tss_reserved2;
 	unsigned long	tss_ist[7];
 	unsigned long	tss_reserved3;
-	unsigned int	tss_iobase;
 	unsigned int	tss_reserved4;
-} __attribute__((__packed__)) mytss;
+	unsigned short	tss_reserved5;
+	unsigned short	tss_iobase;
+} __attribute__((__packed__));
+
+/*
+ * Page faults run on a stack of their own (IST 1), since the faulting
+ * stack may be a guard page or not yet committed.
+ */
+#define PFSTACK_SIZE 4096
+static struct tss cpu_tss[BMK_MAXCPUS];
+static char pfstack[BMK_MAXCPUS][PFSTACK_SIZE] __attribute__((aligned(16)));
 
 static struct gate_descriptor idt[256] __attribute__ ((aligned(16)));
 
@@ -103,7 +112,6 @@ x86_fillgate(int num, void *fun, int ist)
 }
 
 #if 0
-static char intrstack[4096];
 static char nmistack[4096];
 static char dfstack[4096];
 #endif
@@ -113,15 +121,20 @@ _init_taskgate(unsigned long cpu)
 {
 	unsigned long d = 4 + cpu * 2; /* TSS descriptor offset. */
 	struct taskgate_descriptor *td = (void *)&cpu_gdt64[d];
+	struct tss *tss = &cpu_tss[cpu];
+	unsigned long base = (unsigned long)tss;
+
+	tss->tss_ist[0] = (unsigned long)pfstack[cpu] + PFSTACK_SIZE;
+	tss->tss_iobase = sizeof(*tss);
 
-	td->td_lolimit = 0;
-	td->td_lobase = 0;
+	td->td_lolimit = sizeof(*tss) - 1;
+	td->td_lobase = base & 0xffffff;
 	td->td_type = 0x9;
 	td->td_dpl = 0;
 	td->td_p = 1;
-	td->td_hilimit = 0xf;
+	td->td_hilimit = 0;
 	td->td_gran = 0;
-	td->td_hibase = 0xffffffffffUL;
+	td->td_hibase = base >> 24;
 	td->td_zero = 0;
 	amd64_ltr(d*8);
 }
@@ -146,9 +159,8 @@ cpu_init(void)
 	/*
 	 * fill TSS
 	 */
-	mytss.tss_ist[0] = (unsigned long)intrstack + sizeof(intrstack)-16;
-	mytss.tss_ist[1] = (unsigned long)nmistack + sizeof(nmistack)-16;
-	mytss.tss_ist[2] = (unsigned long)dfstack + sizeof(dfstack)-16;
+	cpu_tss[0].tss_ist[1] = (unsigned long)nmistack + sizeof(nmistack)-16;
+	cpu_tss[0].tss_ist[2] = (unsigned long)dfstack + sizeof(dfstack)-16;
 #endif
 
 	_init_taskgate(0);
@@ -183,6 +195,8 @@ void
 bmk_platform_cpu_sched_settls(struct bmk_tcb *next)
 {
 
+	amd64_vmem_switch();
+
 	__asm__ __volatile("wrmsr" ::
 		"c" (0xc0000100),
 		"a" ((uint32_t)(next->btcb_tp)),
@@ -0,0 +1,651 @@
+/*-
+ * Copyright (c) 2020 Ruslan Nikolaev.  All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Demand-paged virtual memory.  Physical memory is identity mapped
+ * through the first PML4 slot; the second slot (512GB-1TB) is a window
+ * from which address ranges are reserved without backing memory.
+ * Pages are allocated zeroed on the first touch by the page fault
+ * handler and can be discarded again.
+ *
+ * Guard pages are non-present entries marked with PG_GUARD.  In
+ * the identity map, the 2MB page holding a guard is split into
+ * 4kB pages.
+ *
+ * There are no TLB shootdown IPIs.  Pages whose mappings are removed
+ * are kept on a deferred list until every CPU has flushed its TLB,
+ * which happens on the next context switch or before the CPU halts.
+ * Released address ranges stay reserved until then as well, and
+ * discard waits for it, so that no CPU can reach the old pages
+ * through an address which has been handed out again.
+ */
+
+#include <hw/kernel.h>
+
+#include <bmk-core/core.h>
+#include <bmk-core/memalloc.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/printf.h>
+#include <bmk-core/queue.h>
+#include <bmk-core/sched.h>
+#include <bmk-core/simple_lock.h>
+
+#define VMEM_BASE	(1UL<<39)
+#define VMEM_END	(2UL<<39)
+
+#define PT_SHIFT(lvl)	(BMK_PCPU_PAGE_SHIFT + 9*(lvl))
+#define PT_INDEX(va, lvl) (((va) >> PT_SHIFT(lvl)) & 0x1ff)
+
+#define PG_GUARD	0x200	/* software bit: guard page */
+
+#define PGEX_P		0x01	/* fault on a present page */
+
+/* above this many pages it is cheaper to reload %cr3 than invlpg */
+#define VMEM_INVLPG_MAX	32
+
+/*
+ * Reserved ranges, sorted.  A released range with vr_gen set is kept
+ * until every CPU has flushed that generation, so that first fit
+ * does not hand it out while stale TLB entries may point into it.
+ */
+struct vmem_range {
+	unsigned long vr_start, vr_end;
+	unsigned long vr_gen;
+	TAILQ_ENTRY(vmem_range) vr_entries;
+};
+static TAILQ_HEAD(, vmem_range) vmem_ranges
+    = TAILQ_HEAD_INITIALIZER(vmem_ranges);
+static struct vmem_range *vmem_hint;
+static unsigned long vmem_nreleased;
+
+static bmk_simple_lock_t vmem_slock =
+    BMK_SIMPLE_LOCK_INITIALIZER_FLAGS(BMK_SIMPLE_LOCK_PV);
+
+/*
+ * TLB flush tracking.  vmem_gen is bumped every time mappings are
+ * removed; a CPU has no stale entries for generations up to its
+ * vc_gen, and none at all while vc_idle is set.
+ */
+static struct vmem_cpu {
+	unsigned long vc_gen;
+	int vc_idle;
+} __attribute__((aligned(BMK_PCPU_L1_SIZE))) vmem_cpu[BMK_MAXCPUS];
+static unsigned long vmem_gen;
+
+/*
+ * Pages waiting for every CPU to flush generation vmem_deferred_gen.
+ * They cannot be linked through themselves since a stale TLB entry
+ * elsewhere might still write to them.
+ */
+#define VMEM_DEFER_MAX (BMK_PCPU_PAGE_SIZE/sizeof(void *) - 2)
+struct vmem_defer {
+	struct vmem_defer *vd_next;
+	unsigned long vd_n;
+	void *vd_pages[VMEM_DEFER_MAX];
+};
+static struct vmem_defer *vmem_deferred;
+static unsigned long vmem_deferred_gen;
+
+static inline unsigned long
+rcr3(void)
+{
+	unsigned long v;
+
+	__asm__ __volatile__("movq %%cr3, %0" : "=r"(v));
+	return v;
+}
+
+static inline void
+tlbflush(void)
+{
+
+	__asm__ __volatile__("movq %0, %%cr3" :: "r"(rcr3()) : "memory");
+}
+
+static inline void
+invlpg(unsigned long va)
+{
+
+	__asm__ __volatile__("invlpg (%0)" :: "r"(va) : "memory");
+}
+
+/*
+ * Return the page table entry for va, or NULL if a page table on the
+ * way is missing and alloc is not set.  Called with the lock held.
+ */
+static unsigned long *
+vmem_pte(unsigned long va, int alloc)
+{
+	unsigned long *pt, *pte;
+	void *npt;
+	int lvl;
+
+	pt = (unsigned long *)(rcr3() & PG_FRAME);
+	for (lvl = 3; lvl > 0; lvl--) {
+		pte = &pt[PT_INDEX(va, lvl)];
+		if ((*pte & PG_V) == 0) {
+			if (!alloc || (npt = bmk_pgalloc_zero(0)) == NULL)
+				return NULL;
+			*pte = (unsigned long)npt | PG_V | PG_RW;
+		}
+		pt = (unsigned long *)(*pte & PG_FRAME);
+	}
+	return &pt[PT_INDEX(va, 0)];
+}
+
+/*
+ * Return the 4kB page table entry for va in the identity map, or
+ * NULL if va is mapped by a large page and split is not set (or
+ * no memory is left for splitting).  Called with the lock held,
+ * unless just looking.
+ */
+static unsigned long *
+identity_pte(unsigned long va, int split)
+{
+	unsigned long *pt, *pte, pa;
+	int lvl, i;
+
+	pt = (unsigned long *)(rcr3() & PG_FRAME);
+	for (lvl = 3; lvl > 0; lvl--) {
+		pte = &pt[PT_INDEX(va, lvl)];
+		if ((*pte & PG_V) == 0)
+			return NULL;
+		if (*pte & PG_PS) {
+			if (!split || lvl != 1
+			    || (pt = bmk_pgalloc(0)) == NULL)
+				return NULL;
+			pa = *pte & PG_FRAME;
+			for (i = 0; i < 512; i++)
+				pt[i] = (pa + i*BMK_PCPU_PAGE_SIZE)
+				    | PG_V | PG_RW;
+			*pte = (unsigned long)pt | PG_V | PG_RW;
+			invlpg(va);
+			continue;
+		}
+		pt = (unsigned long *)(*pte & PG_FRAME);
+	}
+	return &pt[PT_INDEX(va, 0)];
+}
+
+static struct vmem_range *
+vmem_lookup(unsigned long va)
+{
+	struct vmem_range *vr;
+
+	if ((vr = vmem_hint) != NULL
+	    && va >= vr->vr_start && va < vr->vr_end)
+		return vr;
+	TAILQ_FOREACH(vr, &vmem_ranges, vr_entries) {
+		if (va < vr->vr_start)
+			break;
+		if (va < vr->vr_end)
+			return vr->vr_gen ? NULL : (vmem_hint = vr);
+	}
+	return NULL;
+}
+
+/* Oldest generation some CPU may still have TLB entries from. */
+static unsigned long
+vmem_mingen(void)
+{
+	unsigned long i, gen, min;
+
+	min = __atomic_load_n(&vmem_gen, __ATOMIC_SEQ_CST);
+	for (i = 0; i < bmk_numcpus; i++) {
+		if (__atomic_load_n(&vmem_cpu[i].vc_idle, __ATOMIC_SEQ_CST))
+			continue;
+		gen = __atomic_load_n(&vmem_cpu[i].vc_gen, __ATOMIC_SEQ_CST);
+		if (gen < min)
+			min = gen;
+	}
+	return min;
+}
+
+/*
+ * Hand deferred pages back to the page allocator and drop released
+ * ranges once all CPUs have flushed since they were unmapped.  Called
+ * with the lock held.
+ */
+static void
+vmem_reclaim(void)
+{
+	struct vmem_defer *vd;
+	struct vmem_range *vr, *nvr;
+	unsigned long i, mingen;
+
+	if (vmem_deferred == NULL && vmem_nreleased == 0)
+		return;
+	mingen = vmem_mingen();
+	if (vmem_deferred_gen <= mingen) {
+		while ((vd = vmem_deferred) != NULL) {
+			vmem_deferred = vd->vd_next;
+			for (i = 0; i < vd->vd_n; i++)
+				bmk_pgfree(vd->vd_pages[i], 0);
+			bmk_pgfree(vd, 0);
+		}
+	}
+	if (vmem_nreleased == 0)
+		return;
+	TAILQ_FOREACH_SAFE(vr, &vmem_ranges, vr_entries, nvr) {
+		if (vr->vr_gen == 0 || vr->vr_gen > mingen)
+			continue;
+		TAILQ_REMOVE(&vmem_ranges, vr, vr_entries);
+		vmem_nreleased--;
+		bmk_memfree(vr, BMK_MEMWHO_WIREDBMK);
+	}
+}
+
+static void
+vmem_defer(void *p)
+{
+	struct vmem_defer *vd = vmem_deferred;
+
+	if (vd == NULL || vd->vd_n == VMEM_DEFER_MAX) {
+		if ((vd = bmk_pgalloc(0)) == NULL)
+			return; /* the page leaks, but that beats reusing it */
+		vd->vd_next = vmem_deferred;
+		vd->vd_n = 0;
+		vmem_deferred = vd;
+	}
+	vd->vd_pages[vd->vd_n++] = p;
+}
+
+/*
+ * Unmap and free whatever is resident in [start, end), and remove
+ * guards if unguard is set.  Returns the generation other CPUs must
+ * flush before they stop seeing the old pages, or 0 if nothing was
+ * mapped.  Called with the lock held.
+ */
+static unsigned long
+vmem_clear(unsigned long start, unsigned long end, int unguard)
+{
+	struct vmem_cpu *vc = &vmem_cpu[bmk_get_cpu_info()->cpu];
+	unsigned long va, *pte, gen, npages = 0;
+	void *p;
+
+	for (va = start; va < end; va += BMK_PCPU_PAGE_SIZE) {
+		if ((pte = vmem_pte(va, 0)) == NULL) {
+			/* no page table, skip to the next one */
+			va = (va | ((1UL<<PT_SHIFT(1))-1))
+			    - (BMK_PCPU_PAGE_SIZE-1);
+			continue;
+		}
+		if ((*pte & PG_FRAME) == 0) {
+			if (unguard)
+				*pte = 0;
+			continue;
+		}
+
+		p = (void *)(*pte & PG_FRAME);
+		*pte = unguard ? 0 : (*pte & PG_GUARD);
+		vmem_defer(p);
+		if (++npages <= VMEM_INVLPG_MAX)
+			invlpg(va);
+	}
+	if (npages == 0)
+		return 0;
+
+	/*
+	 * Our own invlpgs only cover this generation, flush everything
+	 * if we had not caught up with the previous ones yet.
+	 */
+	gen = __atomic_add_fetch(&vmem_gen, 1, __ATOMIC_SEQ_CST);
+	if (npages > VMEM_INVLPG_MAX || vc->vc_gen != gen - 1)
+		tlbflush();
+	vmem_deferred_gen = gen;
+	__atomic_store_n(&vc->vc_gen, gen, __ATOMIC_SEQ_CST);
+	vmem_reclaim();
+	return gen;
+}
+
+void *
+bmk_platform_vmem_reserve(unsigned long len)
+{
+	struct vmem_range *vr, *nvr;
+	unsigned long start = VMEM_BASE;
+
+	len = (len + BMK_PCPU_PAGE_SIZE-1) & ~(BMK_PCPU_PAGE_SIZE-1UL);
+	if (len == 0 || len > VMEM_END - VMEM_BASE)
+		return NULL;
+	if ((nvr = bmk_memalloc(sizeof(*nvr), 0, BMK_MEMWHO_WIREDBMK)) == NULL)
+		return NULL;
+
+	/* first fit */
+	bmk_simple_lock_enter(&vmem_slock);
+	vmem_reclaim();
+	TAILQ_FOREACH(vr, &vmem_ranges, vr_entries) {
+		if (vr->vr_start - start >= len)
+			break;
+		start = vr->vr_end;
+	}
+	if (VMEM_END - start < len) {
+		bmk_simple_lock_exit(&vmem_slock);
+		bmk_memfree(nvr, BMK_MEMWHO_WIREDBMK);
+		return NULL;
+	}
+	nvr->vr_start = start;
+	nvr->vr_end = start + len;
+	nvr->vr_gen = 0;
+	if (vr)
+		TAILQ_INSERT_BEFORE(vr, nvr, vr_entries);
+	else
+		TAILQ_INSERT_TAIL(&vmem_ranges, nvr, vr_entries);
+	bmk_simple_lock_exit(&vmem_slock);
+
+	return (void *)start;
+}
+
+/*
+ * Release [addr, addr+len), which must lie within one reserved range.
+ * Returns nonzero if it does not.  If anything was mapped, the
+ * addresses are only reused after every CPU has flushed.
+ */
+int
+bmk_platform_vmem_release(void *addr, unsigned long len)
+{
+	struct vmem_range *vr, *nvr, *rvr, *dead = NULL;
+	unsigned long start = (unsigned long)addr, end = start + len, gen;
+
+	nvr = bmk_memalloc(sizeof(*nvr), 0, BMK_MEMWHO_WIREDBMK);
+	rvr = bmk_memalloc(sizeof(*rvr), 0, BMK_MEMWHO_WIREDBMK);
+	if (nvr == NULL || rvr == NULL) {
+		bmk_memfree(nvr, BMK_MEMWHO_WIREDBMK);
+		bmk_memfree(rvr, BMK_MEMWHO_WIREDBMK);
+		return BMK_ENOMEM;
+	}
+
+	bmk_simple_lock_enter(&vmem_slock);
+	if ((vr = vmem_lookup(start)) == NULL || end > vr->vr_end) {
+		bmk_simple_lock_exit(&vmem_slock);
+		bmk_memfree(nvr, BMK_MEMWHO_WIREDBMK);
+		bmk_memfree(rvr, BMK_MEMWHO_WIREDBMK);
+		return BMK_EINVAL;
+	}
+	gen = vmem_clear(start, end, 1);
+
+	if (start > vr->vr_start && end < vr->vr_end) {
+		/* hole in the middle */
+		nvr->vr_start = end;
+		nvr->vr_end = vr->vr_end;
+		nvr->vr_gen = 0;
+		vr->vr_end = start;
+		TAILQ_INSERT_AFTER(&vmem_ranges, vr, nvr, vr_entries);
+		nvr = NULL;
+	} else if (start > vr->vr_start) {
+		vr->vr_end = start;
+	} else if (end < vr->vr_end) {
+		vr->vr_start = end;
+	} else {
+		/* all of it, keep vr itself as the released range */
+		if (vmem_hint == vr)
+			vmem_hint = NULL;
+		if (gen) {
+			vr->vr_gen = gen;
+			vmem_nreleased++;
+		} else {
+			TAILQ_REMOVE(&vmem_ranges, vr, vr_entries);
+			dead = vr;
+		}
+		gen = 0;
+	}
+
+	if (gen) {
+		rvr->vr_start = start;
+		rvr->vr_end = end;
+		rvr->vr_gen = gen;
+		if (vr->vr_start == end)
+			TAILQ_INSERT_BEFORE(vr, rvr, vr_entries);
+		else
+			TAILQ_INSERT_AFTER(&vmem_ranges, vr, rvr, vr_entries);
+		vmem_nreleased++;
+		rvr = NULL;
+	}
+	vmem_reclaim();
+	bmk_simple_lock_exit(&vmem_slock);
+
+	bmk_memfree(nvr, BMK_MEMWHO_WIREDBMK);
+	bmk_memfree(rvr, BMK_MEMWHO_WIREDBMK);
+	bmk_memfree(dead, BMK_MEMWHO_WIREDBMK);
+	return 0;
+}
+
+/*
+ * Drop the backing pages, the next touch gets fresh zero pages.  A CPU
+ * which has not flushed yet could still write the old pages, where
+ * the writes would be lost, so wait until all CPUs have.
+ */
+void
+bmk_platform_vmem_discard(void *addr, unsigned long len)
+{
+	unsigned long start = (unsigned long)addr, gen;
+
+	bmk_simple_lock_enter(&vmem_slock);
+	gen = vmem_clear(start, start + len, 0);
+	bmk_simple_lock_exit(&vmem_slock);
+
+	while (gen != 0 && vmem_mingen() < gen)
+		bmk_sched_yield();
+}
+
+/*
+ * Make [addr, addr+len) inaccessible, or accessible again.  Contents
+ * are kept.  Other CPUs may keep a stale entry for the page until
+ * they next flush for some other reason: guards are there to catch
+ * stray accesses, not worth turning every thread creation into a
+ * flush everywhere.
+ */
+int
+bmk_platform_guard(void *addr, unsigned long len, int guard)
+{
+	struct vmem_range *vr;
+	unsigned long start = (unsigned long)addr, end = start + len;
+	unsigned long va, *pte;
+	int rv = 0;
+
+	if (((start | len) & (BMK_PCPU_PAGE_SIZE-1)) != 0)
+		return BMK_EINVAL;
+
+	bmk_simple_lock_enter(&vmem_slock);
+	if (start >= VMEM_BASE
+	    && ((vr = vmem_lookup(start)) == NULL || end > vr->vr_end)) {
+		rv = BMK_EINVAL;
+		goto out;
+	}
+	for (va = start; va < end; va += BMK_PCPU_PAGE_SIZE) {
+		/* missing page tables or large pages never had a guard */
+		pte = start >= VMEM_BASE
+		    ? vmem_pte(va, guard) : identity_pte(va, guard);
+		if (pte == NULL) {
+			if (guard)
+				rv = BMK_ENOMEM;
+			continue;
+		}
+		if (guard) {
+			*pte = (*pte & ~PG_V) | PG_GUARD;
+			invlpg(va);
+		} else {
+			*pte &= ~PG_GUARD;
+			if (*pte & PG_FRAME)
+				*pte |= PG_V;
+		}
+	}
+ out:
+	bmk_simple_lock_exit(&vmem_slock);
+	return rv;
+}
+
+int
+bmk_platform_vmem_resident(void *addr)
+{
+	unsigned long *pte;
+	int rv;
+
+	bmk_simple_lock_enter(&vmem_slock);
+	pte = vmem_pte((unsigned long)addr, 0);
+	rv = pte && (*pte & PG_FRAME);
+	bmk_simple_lock_exit(&vmem_slock);
+
+	return rv;
+}
+
+/*
+ * Back [addr, addr+len) right away, guard pages excepted.  For memory
+ * which must never fault, thread stacks in particular: the fault
+ * handler takes vmem_slock and allocates pages, so code holding those
+ * locks must not fault.  Memory outside the window is always backed.
+ */
+int
+bmk_platform_vmem_commit(void *addr, unsigned long len)
+{
+	struct vmem_range *vr;
+	unsigned long start, end, va, *pte;
+	void *p;
+	int rv = 0;
+
+	start = (unsigned long)addr & ~(BMK_PCPU_PAGE_SIZE-1);
+	end = ((unsigned long)addr + len + BMK_PCPU_PAGE_SIZE-1)
+	    & ~(BMK_PCPU_PAGE_SIZE-1);
+	if (start < VMEM_BASE || start >= VMEM_END)
+		return 0;
+
+	bmk_simple_lock_enter(&vmem_slock);
+	if ((vr = vmem_lookup(start)) == NULL || end > vr->vr_end) {
+		rv = BMK_EINVAL;
+		goto out;
+	}
+	for (va = start; va < end; va += BMK_PCPU_PAGE_SIZE) {
+		if ((pte = vmem_pte(va, 1)) == NULL) {
+			rv = BMK_ENOMEM;
+			break;
+		}
+		if (*pte & (PG_V|PG_GUARD))
+			continue;
+		if ((p = bmk_pgalloc_zero(0)) == NULL) {
+			rv = BMK_ENOMEM;
+			break;
+		}
+		*pte = (unsigned long)p | PG_V | PG_RW;
+	}
+ out:
+	bmk_simple_lock_exit(&vmem_slock);
+	return rv;
+}
+
+/*
+ * Called from the page fault trap with interrupts disabled.  Returns
+ * nonzero if the fault was resolved.
+ */
+int
+cpu_pagefault(unsigned long va, unsigned long err)
+{
+	unsigned long *pte;
+	void *p;
+	int rv = 0;
+
+	/* protection violations are never ours */
+	if (err & PGEX_P)
+		return 0;
+	if (va < VMEM_BASE) {
+		if ((pte = identity_pte(va, 0)) != NULL && (*pte & PG_GUARD))
+			bmk_printf("guard page hit at 0x%lx\n", va);
+		return 0;
+	}
+	if (va >= VMEM_END)
+		return 0;
+
+	bmk_simple_lock_enter(&vmem_slock);
+	if (vmem_lookup(va) == NULL)
+		goto out;
+
+	if ((pte = vmem_pte(va, 1)) == NULL)
+		bmk_platform_halt("vmem: out of memory for page tables");
+	if (*pte & PG_GUARD) {
+		bmk_printf("guard page hit at 0x%lx\n", va);
+		goto out;
+	}
+	/* another CPU might have got here first */
+	if ((*pte & PG_V) == 0) {
+		if ((p = bmk_pgalloc_zero(0)) == NULL)
+			bmk_platform_halt("vmem: out of memory");
+		*pte = (unsigned long)p | PG_V | PG_RW;
+	}
+	rv = 1;
+ out:
+	bmk_simple_lock_exit(&vmem_slock);
+	return rv;
+}
+
+/*
+ * TLB flush hooks.  amd64_vmem_switch() runs on every context switch,
+ * amd64_vmem_idle() around halting the CPU.
+ */
+void
+amd64_vmem_switch(void)
+{
+	struct vmem_cpu *vc = &vmem_cpu[bmk_get_cpu_info()->cpu];
+	unsigned long gen;
+
+	gen = __atomic_load_n(&vmem_gen, __ATOMIC_SEQ_CST);
+	if (vc->vc_gen == gen)
+		return;
+	tlbflush();
+	__atomic_store_n(&vc->vc_gen, gen, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Called from the scheduler idle loop.  An idle CPU never switches
+ * and the loop does not halt, so catch up here, and free what the
+ * other CPUs were waiting on us for.
+ */
+void
+bmk_platform_vmem_idle(void)
+{
+
+	amd64_vmem_switch();
+	if (__atomic_load_n(&vmem_deferred, __ATOMIC_RELAXED) == NULL
+	    && __atomic_load_n(&vmem_nreleased, __ATOMIC_RELAXED) == 0)
+		return;
+	bmk_simple_lock_enter(&vmem_slock);
+	vmem_reclaim();
+	bmk_simple_lock_exit(&vmem_slock);
+}
+
+void
+amd64_vmem_idle(int idle)
+{
+	struct vmem_cpu *vc = &vmem_cpu[bmk_get_cpu_info()->cpu];
+
+	if (__atomic_load_n(&vmem_gen, __ATOMIC_RELAXED) == 0)
+		return;
+	if (idle) {
+		tlbflush();
+		__atomic_store_n(&vc->vc_idle, 1, __ATOMIC_SEQ_CST);
+	} else {
+		__atomic_store_n(&vc->vc_gen,
+		    __atomic_load_n(&vmem_gen, __ATOMIC_SEQ_CST),
+		    __ATOMIC_SEQ_CST);
+		__atomic_store_n(&vc->vc_idle, 0, __ATOMIC_SEQ_CST);
+	}
+}
@@ -155,6 +155,54 @@ bmk_platform_cpu_sched_settls(struct bmk_tcb *next)
 #endif
 }
 
+/*
+ * No demand paging or guard pages, callers fall back to wired memory.
+ */
+void *
+bmk_platform_vmem_reserve(unsigned long len)
+{
+
+	return NULL;
+}
+
+int
+bmk_platform_vmem_release(void *addr, unsigned long len)
+{
+
+	return BMK_EINVAL;
+}
+
+void
+bmk_platform_vmem_discard(void *addr, unsigned long len)
+{
+}
+
+int
+bmk_platform_vmem_resident(void *addr)
+{
+
+	return 1;
+}
+
+int
+bmk_platform_vmem_commit(void *addr, unsigned long len)
+{
+
+	return 0;
+}
+
+void
+bmk_platform_vmem_idle(void)
+{
+}
+
+int
+bmk_platform_guard(void *addr, unsigned long len, int guard)
+{
+
+	return BMK_EINVAL;
+}
+
 /* timer is 1MHz, we use divisor 256 */
 #define NSEC_PER_TICK ((1000*1000*1000ULL)/(1000*1000/256))
 
@@ -188,6 +236,11 @@ bmk_platform_cpu_block(bmk_time_t until)
 	outl(INTR_CLEAR, 0x80);
 }
 
+void
+bmk_platform_cpu_yield(void)
+{
+}
+
 int
 cpu_intr_init(int intr)
 {
@@ -166,3 +166,51 @@ bmk_platform_cpu_sched_settls(struct bmk_tcb *next)
 
 	adjustgs(next->btcb_tp);
 }
+
+/*
+ * No demand paging or guard pages, callers fall back to wired memory.
+ */
+void *
+bmk_platform_vmem_reserve(unsigned long len)
+{
+
+	return NULL;
+}
+
+int
+bmk_platform_vmem_release(void *addr, unsigned long len)
+{
+
+	return BMK_EINVAL;
+}
+
+void
+bmk_platform_vmem_discard(void *addr, unsigned long len)
+{
+}
+
+int
+bmk_platform_vmem_resident(void *addr)
+{
+
+	return 1;
+}
+
+int
+bmk_platform_vmem_commit(void *addr, unsigned long len)
+{
+
+	return 0;
+}
+
+void
+bmk_platform_vmem_idle(void)
+{
+}
+
+int
+bmk_platform_guard(void *addr, unsigned long len, int guard)
+{
+
+	return BMK_EINVAL;
+}
@@ -47,6 +47,7 @@
 
 #include <xen/memory.h>
 #include <xen/hvm/params.h>
+#include <xen/balloon.h>
 #include <xen/network.h>
 
 #define MP_MAGIC 0x5F504D5FU
@@ -280,6 +281,243 @@ static void x86_mp_init(void)
 	bmk_printf("all %u CPUs are awake\n", total_cpus);
 }
 
+/*
+ * NUMA topology from the ACPI SRAT.  Only what is needed to tell which
+ * node memory ranges and CPUs belong to is parsed.  Proximity domains
+ * are renumbered into dense node numbers in the order they are seen.
+ */
+struct acpi_rsdp {
+	char rp_signature[8];
+	uint8_t rp_checksum;
+	char rp_oem[6];
+	uint8_t rp_revision;
+	uint32_t rp_rsdt;
+	uint32_t rp_length;
+	uint64_t rp_xsdt;
+	uint8_t rp_xchecksum;
+	uint8_t rp_reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+	char ah_signature[4];
+	uint32_t ah_length;
+	uint8_t ah_revision;
+	uint8_t ah_checksum;
+	char ah_oem[6];
+	char ah_oem_table[8];
+	uint32_t ah_oem_revision;
+	uint32_t ah_creator;
+	uint32_t ah_creator_revision;
+} __attribute__((packed));
+
+struct acpi_srat {
+	struct acpi_header as_header;
+	uint32_t as_reserved1;
+	uint64_t as_reserved2;
+} __attribute__((packed));
+
+#define X86_SRAT_TYPE_CPU	0
+#define X86_SRAT_TYPE_MEM	1
+#define X86_SRAT_TYPE_X2APIC	2
+
+#define X86_SRAT_ENABLED	0x1
+
+struct x86_srat_entry {
+	uint8_t se_type;
+	uint8_t se_length;
+} __attribute__((packed));
+
+struct x86_srat_cpu {
+	uint8_t sc_type;
+	uint8_t sc_length;
+	uint8_t sc_domain_lo;
+	uint8_t sc_apic_id;
+	uint32_t sc_flags;
+	uint8_t sc_sapic_eid;
+	uint8_t sc_domain_hi[3];
+	uint32_t sc_clock_domain;
+} __attribute__((packed));
+
+struct x86_srat_mem {
+	uint8_t sm_type;
+	uint8_t sm_length;
+	uint32_t sm_domain;
+	uint16_t sm_reserved1;
+	uint64_t sm_base;
+	uint64_t sm_size;
+	uint32_t sm_reserved2;
+	uint32_t sm_flags;
+	uint64_t sm_reserved3;
+} __attribute__((packed));
+
+struct x86_srat_x2apic {
+	uint8_t sx_type;
+	uint8_t sx_length;
+	uint16_t sx_reserved1;
+	uint32_t sx_domain;
+	uint32_t sx_apic_id;
+	uint32_t sx_flags;
+	uint32_t sx_clock_domain;
+	uint32_t sx_reserved2;
+} __attribute__((packed));
+
+static uint32_t x86_numa_domains[BMK_PGALLOC_MAXNODES];
+static unsigned int x86_numa_ndomains;
+static uint8_t x86_apic_node[256];
+
+static int x86_acpi_checksum(const void *p, unsigned long len)
+{
+	const uint8_t *b = p;
+	uint8_t sum = 0;
+
+	while (len--)
+		sum += *b++;
+	return sum == 0;
+}
+
+static struct acpi_rsdp * x86_rsdp_locate(char * start, char * end)
+{
+	for (; start < end; start += 16) {
+		if (bmk_strncmp(start, "RSD PTR ", 8) == 0 &&
+				x86_acpi_checksum(start, 20))
+			return (struct acpi_rsdp *) start;
+	}
+	return NULL;
+}
+
+static struct acpi_header * x86_acpi_find(const char *sig)
+{
+	struct acpi_rsdp * rsdp;
+	struct acpi_header * sdt, * hdr;
+	char * ebda;
+	unsigned long i, n, width;
+
+	ebda = (char *) ((uintptr_t) bios_ebda_base << 4);
+	rsdp = x86_rsdp_locate(ebda, ebda + 1024);
+	if (!rsdp)
+		rsdp = x86_rsdp_locate((char *) 0xE0000, (char *) 0x100000);
+	if (!rsdp)
+		return NULL;
+
+	/* Only the low 4GB are mapped at this point. */
+	if (rsdp->rp_revision >= 2 && rsdp->rp_xsdt != 0 &&
+			rsdp->rp_xsdt < 0x100000000ULL) {
+		sdt = (struct acpi_header *) (uintptr_t) rsdp->rp_xsdt;
+		width = sizeof(uint64_t);
+	} else {
+		sdt = (struct acpi_header *) (uintptr_t) rsdp->rp_rsdt;
+		width = sizeof(uint32_t);
+	}
+	if (!x86_acpi_checksum(sdt, sdt->ah_length))
+		return NULL;
+
+	n = (sdt->ah_length - sizeof(*sdt)) / width;
+	for (i = 0; i < n; i++) {
+		char *ent = (char *) (sdt + 1) + i * width;
+		uint64_t addr = (width == sizeof(uint64_t)) ?
+			*(uint64_t *) ent : *(uint32_t *) ent;
+
+		if (addr == 0 || addr >= 0x100000000ULL)
+			continue;
+		hdr = (struct acpi_header *) (uintptr_t) addr;
+		if (bmk_strncmp(hdr->ah_signature, sig, 4) == 0 &&
+				x86_acpi_checksum(hdr, hdr->ah_length))
+			return hdr;
+	}
+	return NULL;
+}
+
+static int x86_numa_node(uint32_t domain)
+{
+	unsigned int i;
+
+	for (i = 0; i < x86_numa_ndomains; i++) {
+		if (x86_numa_domains[i] == domain)
+			return i;
+	}
+	if (x86_numa_ndomains == BMK_PGALLOC_MAXNODES) {
+		bmk_printf("NUMA: too many domains, folding %u into node 0\n",
+				domain);
+		return 0;
+	}
+	x86_numa_domains[x86_numa_ndomains] = domain;
+	return x86_numa_ndomains++;
+}
+
+static void x86_numa_init(void)
+{
+	struct acpi_srat * srat;
+	struct x86_srat_entry * entry;
+	struct x86_srat_cpu * cpu;
+	struct x86_srat_mem * mem;
+	struct x86_srat_x2apic * x2apic;
+	char * end;
+	int node;
+
+	srat = (struct acpi_srat *) x86_acpi_find("SRAT");
+	if (!srat)
+		return;
+
+	entry = (struct x86_srat_entry *) (srat + 1);
+	end = (char *) srat + srat->as_header.ah_length;
+	for (; (char *) entry + sizeof(*entry) <= end &&
+			entry->se_length != 0;
+			entry = (struct x86_srat_entry *)
+			((char *) entry + entry->se_length)) {
+		switch (entry->se_type) {
+			case X86_SRAT_TYPE_CPU:
+				cpu = (struct x86_srat_cpu *) entry;
+				if (!(cpu->sc_flags & X86_SRAT_ENABLED))
+					break;
+				x86_apic_node[cpu->sc_apic_id] = x86_numa_node(
+					cpu->sc_domain_lo |
+					(cpu->sc_domain_hi[0] << 8) |
+					(cpu->sc_domain_hi[1] << 16) |
+					((uint32_t) cpu->sc_domain_hi[2] << 24));
+				break;
+			case X86_SRAT_TYPE_X2APIC:
+				x2apic = (struct x86_srat_x2apic *) entry;
+				if (!(x2apic->sx_flags & X86_SRAT_ENABLED) ||
+						x2apic->sx_apic_id >= 256)
+					break;
+				x86_apic_node[x2apic->sx_apic_id] =
+					x86_numa_node(x2apic->sx_domain);
+				break;
+			case X86_SRAT_TYPE_MEM:
+				mem = (struct x86_srat_mem *) entry;
+				if (!(mem->sm_flags & X86_SRAT_ENABLED) ||
+						mem->sm_size == 0)
+					break;
+				node = x86_numa_node(mem->sm_domain);
+				bmk_printf("NUMA: node %d memory [0x%llx,0x%llx)\n",
+					node, (unsigned long long) mem->sm_base,
+					(unsigned long long)
+					(mem->sm_base + mem->sm_size));
+				bmk_pgalloc_loadnode(node, mem->sm_base,
+					mem->sm_base + mem->sm_size);
+				break;
+			default:
+				break;
+		}
+	}
+	bmk_printf("NUMA: %u nodes\n", x86_numa_ndomains);
+}
+
+/* Called on each CPU to record which node it sits on. */
+static void x86_numa_setcpu(unsigned long cpu)
+{
+	uint32_t eax, ebx, ecx, edx;
+	int node;
+
+	if (x86_numa_ndomains <= 1)
+		return;
+	x86_cpuid(1, &eax, &ebx, &ecx, &edx);
+	node = x86_apic_node[ebx >> 24];
+	if (node >= bmk_pgalloc_nnodes())
+		node = 0;
+	bmk_pgalloc_setcpunode(cpu, node);
+}
+
 extern char _minios_hypercall_page[];
 extern char _minios_shared_info[];
 
@@ -371,6 +609,15 @@ x86_xen_init_early(void)
 	x86_xen_init_shared();
 }
 
+/* no-op without Xen; PAUSE already makes KVM reschedule spinners */
+void
+bmk_platform_cpu_yield(void)
+{
+
+	if (xen_base)
+		HYPERVISOR_sched_op(SCHEDOP_yield, NULL);
+}
+
 static void
 x86_xen_init(void)
 {
@@ -387,11 +634,14 @@ x86_xen_init(void)
 
 	x86_xen_init_netmap();
 	bmk_printf("initialized XEN portmap table\n");
+
+	xen_balloon_init();
 }
 
 static volatile int main_cpu_ready = 0;
 
 struct bmk_cpu_info x86_cpu_info[BMK_MAXCPUS];
+bmk_ctassert(BMK_MAXCPUS <= BMK_CORE_MAXCPUS);
 
 void
 x86_boot(struct multiboot_info *mbi, unsigned long cpu)
@@ -411,6 +661,7 @@ x86_boot(struct multiboot_info *mbi, unsigned long cpu)
 		x86_cpu_info[cpu].cpu = cpu;
 		x86_cpu_info[cpu].spldepth = 1;
 		bmk_set_cpu_info(&x86_cpu_info[cpu]);
+		x86_numa_setcpu(cpu);
 
 		/* Initialize interrupts. */
 		cpu_init_notmain(cpu);
@@ -434,6 +685,8 @@ x86_boot(struct multiboot_info *mbi, unsigned long cpu)
 
 	multiboot(mbi);
 
+	x86_numa_init();
+	x86_numa_setcpu(0);
 	x86_mp_init();
 
 	bmk_sched_init();
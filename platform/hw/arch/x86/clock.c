@@ -638,6 +638,9 @@ bmk_platform_cpu_block(bmk_time_t until)
 	 * able to distinguish if the interrupt was the PIT interrupt
 	 * and no other, but this will do for now.
 	 */
+#if defined(__x86_64__)
+	amd64_vmem_idle(1);
+#endif
 	s = cpu->spldepth;
 	cpu->spldepth = 0;
 	__asm__ __volatile__(
@@ -645,4 +648,7 @@ bmk_platform_cpu_block(bmk_time_t until)
 		"hlt;\n"
 		"cli;\n");
 	cpu->spldepth = s;
+#if defined(__x86_64__)
+	amd64_vmem_idle(0);
+#endif
 }
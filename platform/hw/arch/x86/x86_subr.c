@@ -80,6 +80,7 @@ x86_initidt(void)
 #undef FILLGATE
 	x86_fillgate(2, x86_trap_2, 2);
 	x86_fillgate(8, x86_trap_8, 3);
+	x86_fillgate(14, x86_trap_14, 1);
 }
 
 void
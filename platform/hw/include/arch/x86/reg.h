@@ -10,6 +10,11 @@
 #define CR4_OSFXSR	0x00000200 /* OS support for FXSAVE & FXRSTOR */
 #define CR4_PAE		0x00000020 /* Physical Address Extension */
 
+#define PG_V		0x001	/* valid */
+#define PG_RW		0x002	/* writable */
+#define PG_PS		0x080	/* large page */
+#define PG_FRAME	0x000ffffffffff000UL
+
 /* Extended Feature Enable Register */
 #define MSR_EFER	0xc0000080
 
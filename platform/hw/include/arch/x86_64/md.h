@@ -19,6 +19,10 @@ struct region_descriptor;
 void amd64_lidt(struct region_descriptor *);
 void amd64_ltr(unsigned long);
 
+int cpu_pagefault(unsigned long, unsigned long);
+void amd64_vmem_switch(void);
+void amd64_vmem_idle(int);
+
 #include <arch/x86/inline.h>
 
 void cpu_boot(void *);
@@ -0,0 +1,12 @@
+#ifndef __BALLOON_H__
+#define __BALLOON_H__
+
+/*
+ * Let the page allocator return idle memory to Xen and get it back.
+ * Only valid when running as a Xen HVM guest.  How much memory is kept
+ * comes from the "balloon" configuration key, not from xenstore, which
+ * the hw platform has no client for.
+ */
+void	xen_balloon_init(void);
+
+#endif /* __BALLOON_H__ */
@@ -2,6 +2,8 @@
 #define __NETWORK_H__
 
 #include <xen/_rumprun.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/platform.h>
 #include <bmk-core/types.h>
 
 #include "../../../../ifconfig/ifconfig.h"
@@ -50,4 +52,44 @@ int backend_receive(struct mbuf *m0);
 
 extern uint32_t *HYPERVISOR_netdom_map;
 
+/*
+ * NUMA node for the receiver threads and locally allocated rings,
+ * normally the one closest to the NIC.  -1 leaves the receivers
+ * unbound and allocates from whichever node they are set up on.
+ * Only bound receivers are handed straight back to their CPU when
+ * packets arrive as they go to sleep, see bmk_sched_wake_handoff().
+ */
+#ifndef NETDOM_NODE
+#define NETDOM_NODE -1
+#endif
+
+/*
+ * Number of preallocated packet buffers for the rump kernel side of
+ * the interfaces, for standard and for jumbo frames.  Packets which
+ * do not get a buffer go through regular mbuf clusters.
+ */
+#ifndef NETDOM_POOL_BUFS
+#define NETDOM_POOL_BUFS 1024
+#endif
+#ifndef NETDOM_POOL_JUMBOBUFS
+#define NETDOM_POOL_JUMBOBUFS 512
+#endif
+#define NETDOM_POOL_BUFSIZE 2048
+#define NETDOM_POOL_JUMBOSIZE 9216
+
+/* CPU to bind receivers to, -1 for none. */
+static inline int
+netdom_cpu(void)
+{
+	unsigned long i;
+
+	if (NETDOM_NODE < 0)
+		return -1;
+	for (i = 0; i < bmk_numcpus; i++) {
+		if (bmk_pgalloc_cpunode(i) == NETDOM_NODE)
+			return (int) i;
+	}
+	return -1;
+}
+
 #endif
@@ -34,6 +34,8 @@ __KERNEL_RCSID(0, "$NetBSD: if_virt.c,v 1.36 2013/07/04 11:46:51 pooka Exp $");
 #include <sys/kernel.h>
 #include <sys/kmem.h>
 #include <sys/kthread.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
 #include <sys/mutex.h>
 #include <sys/poll.h>
 #include <sys/sockio.h>
@@ -220,27 +222,60 @@ virtif_stop(struct ifnet *ifp, int disable)
 #endif
 }
 
-/* frontend driver -> NetBSD network stack */
-void
-rump_virtif_pktdeliver(struct virtif_sc *sc, const void *data, size_t len)
+static void
+virtif_buffree(struct mbuf *m, void *buf, size_t size, void *arg)
 {
-	struct ifnet *ifp = &sc->sc_ec.ec_if;
-	struct mbuf *m;
 
-	if ((ifp->if_flags & IFF_RUNNING) == 0)
-		return;
+	VIFHYPER_BUFPUT(buf, size);
+	if (__predict_true(m != NULL))
+		pool_cache_put(mb_cache, m);
+}
+
+/*
+ * Copy a frame into an mbuf.  Anything which does not fit in the
+ * header mbuf goes into a single buffer from the hypervisor-side
+ * packet pools if one is available, or into a cluster chain if not.
+ */
+static struct mbuf *
+virtif_getpkt(struct ifnet *ifp, const void *data, size_t len)
+{
+	struct mbuf *m;
+	size_t bufsize;
+	void *buf;
 
 	m = m_gethdr(M_NOWAIT, MT_DATA);
 	if (m == NULL)
-		return; /* drop packet */
+		return NULL;
+
+	if (len > MHLEN && (buf = VIFHYPER_BUFGET(len, &bufsize)) != NULL) {
+		memcpy(buf, data, len);
+		MEXTADD(m, buf, bufsize, M_DEVBUF, virtif_buffree, NULL);
+		m->m_len = m->m_pkthdr.len = len;
+		return m;
+	}
 
 	m->m_len = m->m_pkthdr.len = 0;
 	m_copyback(m, 0, len, data);
 	if (len != m->m_pkthdr.len) {
 		aprint_normal_ifnet(ifp, "m_copyback failed\n");
 		m_freem(m);
-		return;
+		return NULL;
 	}
+	return m;
+}
+
+/* frontend driver -> NetBSD network stack */
+void
+rump_virtif_pktdeliver(struct virtif_sc *sc, const void *data, size_t len)
+{
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+	struct mbuf *m;
+
+	if ((ifp->if_flags & IFF_RUNNING) == 0)
+		return;
+
+	if ((m = virtif_getpkt(ifp, data, len)) == NULL)
+		return; /* drop packet */
 
 #if __NetBSD_Prereq__(7,99,31)
 	m_set_rcvif(m, ifp);
@@ -264,18 +299,9 @@ rump_virtif_pktforward(struct ifnet *ifp, const void *data, size_t len)
 	if ((ifp->if_flags & IFF_RUNNING) == 0)
 		return;
 
-	m = m_gethdr(M_NOWAIT, MT_DATA);
-	if (m == NULL)
+	if ((m = virtif_getpkt(ifp, data, len)) == NULL)
 		return; /* drop packet */
 
-	m->m_len = m->m_pkthdr.len = 0;
-	m_copyback(m, 0, len, data);
-	if (len != m->m_pkthdr.len) {
-		aprint_normal_ifnet(ifp, "m_copyback failed\n");
-		m_freem(m);
-		return;
-	}
-
 #if __NetBSD_Prereq__(7,99,31)
 	m_set_rcvif(m, ifp);
 #else
@@ -35,6 +35,8 @@ int 	VIFHYPER_CREATE(int, struct virtif_sc *, uint8_t *,
 void	VIFHYPER_DYING(struct virtif_user *);
 void	VIFHYPER_DESTROY(struct virtif_user *);
 int	VIFHYPER_SEND(struct virtif_user *, struct mbuf *);
+void *	VIFHYPER_BUFGET(size_t, size_t *);
+void	VIFHYPER_BUFPUT(void *, size_t);
 
 void	rump_virtif_switch(void);
 void	rump_virtif_pktdeliver_direct(struct ifnet *, struct mbuf *);
@@ -27,6 +27,8 @@
 
 #include <bmk-core/errno.h>
 #include <bmk-core/memalloc.h>
+#include <bmk-core/objpool.h>
+#include <bmk-core/simple_lock.h>
 #include <bmk-core/string.h>
 #include <bmk-core/sched.h>
 #include <bmk-core/platform.h>
@@ -40,6 +42,62 @@
 #include "if_virt.h"
 #include "if_virt_user.h"
 
+/*
+ * Packet buffers for received frames, from preallocated per-CPU
+ * pools so that the per-packet path takes no locks.  The pools are
+ * set up on first use.
+ */
+static struct bmk_objpool *pktpool, *jumbopool;
+static bmk_simple_lock_t pktpool_lock = BMK_SIMPLE_LOCK_INITIALIZER;
+static int pktpool_inited;
+
+static void
+pktpool_init(void)
+{
+
+	bmk_simple_lock_enter(&pktpool_lock);
+	if (!pktpool_inited) {
+		pktpool = bmk_objpool_create(NETDOM_POOL_BUFSIZE,
+		    NETDOM_POOL_BUFS, NETDOM_NODE);
+		jumbopool = bmk_objpool_create(NETDOM_POOL_JUMBOSIZE,
+		    NETDOM_POOL_JUMBOBUFS, NETDOM_NODE);
+		if (pktpool == NULL || jumbopool == NULL)
+			bmk_printf("xenif: packet buffer pools not allocated\n");
+		__atomic_store_n(&pktpool_inited, 1, __ATOMIC_RELEASE);
+	}
+	bmk_simple_lock_exit(&pktpool_lock);
+}
+
+void *
+VIFHYPER_BUFGET(size_t len, size_t *bufsize)
+{
+	struct bmk_objpool *op;
+	void *buf;
+
+	if (!__atomic_load_n(&pktpool_inited, __ATOMIC_ACQUIRE))
+		pktpool_init();
+
+	if (len <= NETDOM_POOL_BUFSIZE)
+		op = pktpool;
+	else if (len <= NETDOM_POOL_JUMBOSIZE)
+		op = jumbopool;
+	else
+		return NULL;
+	if (op == NULL || (buf = bmk_objpool_get(op)) == NULL)
+		return NULL;
+	*bufsize = bmk_objpool_objsize(op);
+	return buf;
+}
+
+void
+VIFHYPER_BUFPUT(void *buf, size_t bufsize)
+{
+
+	/* either pool may have failed to allocate, go by the address */
+	bmk_objpool_put(bmk_objpool_owns(pktpool, buf)
+	    ? pktpool : jumbopool, buf);
+}
+
 #ifndef NETDOM_FRONTEND
 int rumpuser_network_receive(struct mbuf *m)
 {
@@ -286,7 +286,7 @@ receiver_callback(struct bmk_thread *prev, struct bmk_block_data *_block)
 	unsigned int dom = block->dom;
 	long old = -1;
 	if (!atomic_compare_exchange_strong(&rx_aring[dom]->readers, &old, 0))
-		bmk_sched_wake(rx_threads[dom].thread);
+		bmk_sched_wake_handoff(rx_threads[dom].thread);
 }
 
 static void backend_forward_receiver(void *arg)
@@ -449,7 +449,8 @@ void backend_connect(evtchn_port_t port)
 	/* create a receiver thread */
 	rx_threads[dom].dom = dom;
 	rx_threads[dom].thread = bmk_sched_create("backend_receiver", NULL, 1,
-		-1, backend_forward_receiver, &rx_threads[dom], NULL, 0);
+		netdom_cpu(), backend_forward_receiver, &rx_threads[dom],
+		NULL, 0);
 	if (rx_threads[dom].thread == NULL)
 		bmk_platform_halt("fatal thread creation failure\n");
 
@@ -0,0 +1,82 @@
+/*
+ * Memory ballooning for Xen HVM guests.  The page allocator picks which
+ * free pages go back to the hypervisor; we only do the hypercalls.
+ * Memory is identity mapped, so a page's gpfn is its address.
+ */
+
+#include <mini-os/os.h>
+#include <xen/memory.h>
+#include <xen/balloon.h>
+
+#include <bmk-core/platform.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/printf.h>
+
+#define BALLOON_BATCH 64
+
+/* returns the number of pages the hypervisor processed */
+static unsigned long
+balloon_op(int op, unsigned long addr, unsigned long npages)
+{
+	xen_pfn_t frames[BALLOON_BATCH];
+	struct xen_memory_reservation res = {
+		.extent_order = 0,
+		.domid = DOMID_SELF,
+	};
+	unsigned long i, n, done = 0;
+	int rv;
+
+	set_xen_guest_handle(res.extent_start, frames);
+	while (done < npages) {
+		n = npages - done;
+		if (n > BALLOON_BATCH)
+			n = BALLOON_BATCH;
+		for (i = 0; i < n; i++)
+			frames[i] = ((addr >> PAGE_SHIFT) + done + i);
+		res.nr_extents = n;
+
+		rv = HYPERVISOR_memory_op(op, &res);
+		if (rv > 0)
+			done += rv;
+		if (rv < 0 || (unsigned long)rv != n)
+			break;
+	}
+	return done;
+}
+
+/*
+ * A partial operation is undone so that the allocator sees each range
+ * as either entirely given or entirely kept.
+ */
+static int
+balloon_give(void *p, unsigned long npages)
+{
+	unsigned long addr = (unsigned long)p, done;
+
+	if ((done = balloon_op(XENMEM_decrease_reservation,
+	    addr, npages)) == npages)
+		return 0;
+	if (balloon_op(XENMEM_populate_physmap, addr, done) != done)
+		bmk_platform_halt("balloon: cannot repopulate memory");
+	return 1;
+}
+
+static int
+balloon_take(void *p, unsigned long npages)
+{
+	unsigned long addr = (unsigned long)p, done;
+
+	if ((done = balloon_op(XENMEM_populate_physmap,
+	    addr, npages)) == npages)
+		return 0;
+	if (balloon_op(XENMEM_decrease_reservation, addr, done) != done)
+		bmk_printf("balloon: lost %lu pages\n", done);
+	return 1;
+}
+
+void
+xen_balloon_init(void)
+{
+
+	bmk_pgalloc_balloon_attach(balloon_give, balloon_take);
+}
@@ -24,6 +24,7 @@
 #include <mini-os/wait.h>
 
 #include <bmk-core/printf.h>
+#include <bmk-core/simple_lock.h>
 #include <bmk-pcpu/pcpu.h>
 
 #define NR_EVS 1024
@@ -51,17 +52,18 @@ void minios_events_register_rump_callback(void (*cb)(u_int))
 
 /* interrupt handler queues events here */
 DECLARE_WAIT_QUEUE_HEAD(minios_events_waitq);
-static DEFINE_SPINLOCK(evt_handler_lock);
+static bmk_simple_lock_t evt_handler_lock =
+    BMK_SIMPLE_LOCK_INITIALIZER_FLAGS(BMK_SIMPLE_LOCK_TICKET|BMK_SIMPLE_LOCK_PV);
 void minios_evtdev_handler(evtchn_port_t port, struct pt_regs * regs,
                            void *data)
 {
     minios_mask_evtchn(port);
 
-    spin_lock(&evt_handler_lock);
+    bmk_simple_lock_enter(&evt_handler_lock);
 
     rump_evtdev_callback(port);
 
-    spin_unlock(&evt_handler_lock);
+    bmk_simple_lock_exit(&evt_handler_lock);
 }
 
 void unbind_all_ports(void)
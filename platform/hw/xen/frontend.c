@@ -133,7 +133,7 @@ static struct netdom_fring * frontend_init_ring(frontend_grefs_t **pgrefs,
 	frontend_grefs_t *grefs;
 	void *buf;
 
-	grefs = bmk_pgalloc(1);
+	grefs = bmk_pgalloc_node(1, NETDOM_NODE);
 	if (!grefs)
 		bmk_platform_halt("grefs shared page not allocated\n");
 	*pgrefs = grefs;
@@ -142,7 +142,8 @@ static struct netdom_fring * frontend_init_ring(frontend_grefs_t **pgrefs,
 	result[1] = gnttab_grant_access(network_dom_info.domid,
 			frontend_virt_to_pfn((char *) grefs + PAGE_SIZE), 0);
 
-	fring = bmk_pgalloc(gntmap_map2order(6 + NETDOM_RING_DATA_PAGES));
+	fring = bmk_pgalloc_huge((6 + NETDOM_RING_DATA_PAGES) * PAGE_SIZE,
+			NETDOM_NODE);
 	if (!fring)
 		bmk_platform_halt("shared pages are not allocated\n");
 	aring = NETDOM_ARING(fring);
@@ -177,7 +178,7 @@ receiver_callback(struct bmk_thread *prev, struct bmk_block_data *_block)
 {
 	long old = -1;
 	if (!atomic_compare_exchange_strong(&NETDOM_ARING(rx_fring)->readers, &old, 0))
-		bmk_sched_wake(rx_thread);
+		bmk_sched_wake_handoff(rx_thread);
 }
 
 static struct bmk_block_data receiver_data = { .callback = receiver_callback };
@@ -425,7 +426,7 @@ void frontend_init(struct virtif_sc * vif_sc)
 	tx_fring = _tx_fring;
 
 	rx_thread = bmk_sched_create("frontend_receiver",
-		NULL, 1, -1, frontend_receiver, NULL, NULL, 0);
+		NULL, 1, netdom_cpu(), frontend_receiver, NULL, NULL, 0);
 
 	atomic_init(&reconnecters, 1);
 
@@ -44,6 +44,7 @@
 #include <xen/version.h>
 
 #include <bmk-core/core.h>
+#include <bmk-core/errno.h>
 #include <bmk-core/printf.h>
 
 struct bmk_cpu_info bmk_xen_cpu_info = { .cpu = 0 };
@@ -96,6 +97,13 @@ bmk_platform_cpu_block(bmk_time_t until)
 	minios_force_evtchn_callback();
 }
 
+void
+bmk_platform_cpu_yield(void)
+{
+
+	HYPERVISOR_sched_op(SCHEDOP_yield, 0);
+}
+
 unsigned long
 bmk_platform_splhigh(void)
 {
@@ -117,6 +125,54 @@ bmk_platform_ready(void)
 {
 }
 
+/*
+ * No demand paging or guard pages, callers fall back to wired memory.
+ */
+void *
+bmk_platform_vmem_reserve(unsigned long len)
+{
+
+	return NULL;
+}
+
+int
+bmk_platform_vmem_release(void *addr, unsigned long len)
+{
+
+	return BMK_EINVAL;
+}
+
+void
+bmk_platform_vmem_discard(void *addr, unsigned long len)
+{
+}
+
+int
+bmk_platform_vmem_resident(void *addr)
+{
+
+	return 1;
+}
+
+int
+bmk_platform_vmem_commit(void *addr, unsigned long len)
+{
+
+	return 0;
+}
+
+void
+bmk_platform_vmem_idle(void)
+{
+}
+
+int
+bmk_platform_guard(void *addr, unsigned long len, int guard)
+{
+
+	return BMK_EINVAL;
+}
+
 /*
  * INITIAL C ENTRY POINT.
  */